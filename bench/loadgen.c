@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Latencies are recorded in nanoseconds into a log-linear histogram laid out
+// like HdrHistogram's: every power of two is split into HIST_HALF linear
+// buckets, which keeps two significant digits for any value.
+#define HIST_SUB_BITS 7
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS 40
+#define HIST_SIZE ((HIST_BUCKETS + 1) * HIST_HALF)
+
+struct Histogram {
+  uint64_t counts[HIST_SIZE];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+};
+
+struct Connection {
+  int fd;
+  int connecting;
+  char* obuf;
+  size_t olen;
+  size_t opos;
+  char* ibuf;
+  size_t ilen;
+  int in_body;
+  long body_remaining;
+  int status;
+  int close_after;
+  // Send times of the requests in flight, oldest at head.
+  uint64_t* sent_at;
+  int head;
+  int inflight;
+};
+
+struct Worker {
+  pthread_t thread;
+  int epoll_fd;
+  struct Connection* conns;
+  int nconns;
+  uint64_t rng;
+  struct Histogram hist;
+  uint64_t requests;
+  uint64_t bytes;
+  uint64_t connects;
+  uint64_t connect_errors;
+  uint64_t read_errors;
+  uint64_t status_errors;
+  uint64_t timeouts;
+};
+
+static void parse_options(int argc, char* argv[]);
+static void add_path(const char* path, int weight);
+static void load_paths(const char* file);
+static void resolve_server(void);
+static void* run_worker(void* arg);
+static void open_connection(struct Worker* w, struct Connection* conn);
+static void reset_connection(struct Worker* w, struct Connection* conn);
+static void handle_event(struct Worker* w, struct Connection* conn,
+                         uint32_t events);
+static void fill_pipeline(struct Worker* w, struct Connection* conn);
+static int flush_requests(struct Worker* w, struct Connection* conn);
+static int read_responses(struct Worker* w, struct Connection* conn);
+static int parse_header(struct Connection* conn, char* p, char* end);
+static void complete_response(struct Worker* w, struct Connection* conn);
+static void expire_requests(struct Worker* w);
+static uint64_t now_ns(void);
+static uint64_t next_random(uint64_t* state);
+static int hist_index(uint64_t value);
+static uint64_t hist_value(int index);
+static void hist_record(struct Histogram* h, uint64_t value);
+static void hist_merge(struct Histogram* to, const struct Histogram* from);
+static uint64_t hist_percentile(const struct Histogram* h, double percentile);
+static void print_report(struct Worker* workers, double elapsed);
+static void print_distribution(const struct Histogram* h);
+static void* xmalloc(size_t sz);
+static void die(const char* fmt, ...);
+
+static const char* USAGE =
+    "Usage: %s [--host=h] [--port=n] [--threads=n] [--connections=n] "
+    "[--duration=sec] [--pipeline=n] [--timeout=sec] [--paths=file] "
+    "[--header=field] [--seed=n] [--hdr] [path[:weight]...]\n";
+
+static const size_t INPUT_BUF_SIZE = 65536;
+static const size_t MAX_REQUEST_SIZE = 2048;
+
+static char* host = "localhost";
+static char* port = "80";
+static int thread_count = 1;
+static int connection_count = 10;
+static int duration = 10;
+static int pipeline = 1;
+static int timeout = 5;
+static uint64_t seed = 1;
+static int print_hdr = 0;
+static char* extra_headers = "";
+
+// Each path appears once per unit of weight, so a uniform pick over the array
+// follows the requested mix.
+static char** paths = NULL;
+static int npaths = 0;
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+static uint64_t deadline;
+
+static struct option longopts[] = {
+    {"host", required_argument, NULL, 'H'},
+    {"port", required_argument, NULL, 'p'},
+    {"threads", required_argument, NULL, 't'},
+    {"connections", required_argument, NULL, 'c'},
+    {"duration", required_argument, NULL, 'd'},
+    {"pipeline", required_argument, NULL, 'P'},
+    {"timeout", required_argument, NULL, 'T'},
+    {"paths", required_argument, NULL, 'f'},
+    {"header", required_argument, NULL, 'r'},
+    {"seed", required_argument, NULL, 's'},
+    {"hdr", no_argument, &print_hdr, 1},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0},
+};
+
+int main(int argc, char* argv[]) {
+  parse_options(argc, argv);
+  resolve_server();
+
+  if (connection_count < thread_count) thread_count = connection_count;
+  struct Worker* workers = calloc(thread_count, sizeof *workers);
+  if (!workers) die("failed to allocate memory");
+  uint64_t start = now_ns();
+  deadline = start + (uint64_t)duration * 1000000000;
+  for (int i = 0; i < thread_count; ++i) {
+    struct Worker* w = &workers[i];
+    w->nconns = connection_count / thread_count +
+                (i < connection_count % thread_count);
+    w->rng = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+    w->hist.min = UINT64_MAX;
+    int err = pthread_create(&w->thread, NULL, run_worker, w);
+    if (err) die("pthread_create(3) failed: %s", strerror(err));
+  }
+  for (int i = 0; i < thread_count; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  print_report(workers, (now_ns() - start) / 1e9);
+  exit(0);
+}
+
+static void parse_options(int argc, char* argv[]) {
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 0:
+        break;
+      case 'H':
+        host = optarg;
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 't':
+        thread_count = atoi(optarg);
+        break;
+      case 'c':
+        connection_count = atoi(optarg);
+        break;
+      case 'd':
+        duration = atoi(optarg);
+        break;
+      case 'P':
+        pipeline = atoi(optarg);
+        break;
+      case 'T':
+        timeout = atoi(optarg);
+        break;
+      case 'f':
+        load_paths(optarg);
+        break;
+      case 'r': {
+        size_t len = strlen(extra_headers) + strlen(optarg) + 3;
+        char* headers = xmalloc(len);
+        snprintf(headers, len, "%s%s\r\n", extra_headers, optarg);
+        extra_headers = headers;
+        break;
+      }
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'h':
+        fprintf(stdout, USAGE, argv[0]);
+        exit(0);
+      case '?':
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+  }
+  for (int i = optind; i < argc; ++i) {
+    char* colon = strrchr(argv[i], ':');
+    int weight = 1;
+    if (colon) {
+      *colon = '\0';
+      weight = atoi(colon + 1);
+    }
+    add_path(argv[i], weight);
+  }
+  if (!npaths) add_path("/", 1);
+  if (strlen(host) + strlen(extra_headers) > MAX_REQUEST_SIZE / 2 - 32) {
+    die("request header too long");
+  }
+  if (thread_count < 1 || connection_count < 1 || duration < 1 ||
+      pipeline < 1 || timeout < 1) {
+    fprintf(stderr, USAGE, argv[0]);
+    exit(1);
+  }
+}
+
+static void add_path(const char* path, int weight) {
+  if (path[0] != '/' || strlen(path) > MAX_REQUEST_SIZE / 2) {
+    die("invalid path: %s", path);
+  }
+  if (weight < 1) die("invalid weight for %s", path);
+  paths = realloc(paths, sizeof(char*) * (npaths + weight));
+  if (!paths) die("failed to allocate memory");
+  char* copy = strdup(path);
+  if (!copy) die("failed to allocate memory");
+  for (int i = 0; i < weight; ++i) paths[npaths++] = copy;
+}
+
+// Reads "path [weight]" lines. Blank lines and lines starting with '#' are
+// skipped.
+static void load_paths(const char* file) {
+  FILE* f = fopen(file, "r");
+  if (!f) die("%s: %s", file, strerror(errno));
+  char line[1024];
+  while (fgets(line, sizeof line, f)) {
+    char path[1024];
+    int weight = 1;
+    if (line[0] == '#' || sscanf(line, "%1023s %d", path, &weight) < 1) {
+      continue;
+    }
+    add_path(path, weight);
+  }
+  fclose(f);
+}
+
+static void resolve_server(void) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res;
+  int err = getaddrinfo(host, port, &hints, &res);
+  if (err) die("getaddrinfo(3): %s", gai_strerror(err));
+  memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+  server_addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+}
+
+static void* run_worker(void* arg) {
+  struct Worker* w = arg;
+  w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (w->epoll_fd < 0) die("epoll_create1(2) failed: %s", strerror(errno));
+  w->conns = calloc(w->nconns, sizeof *w->conns);
+  if (!w->conns) die("failed to allocate memory");
+  for (int i = 0; i < w->nconns; ++i) {
+    struct Connection* conn = &w->conns[i];
+    conn->obuf = xmalloc(MAX_REQUEST_SIZE * pipeline);
+    conn->ibuf = xmalloc(INPUT_BUF_SIZE);
+    conn->sent_at = xmalloc(sizeof(uint64_t) * pipeline);
+    open_connection(w, conn);
+  }
+
+  struct epoll_event events[64];
+  uint64_t next_expiry = now_ns();
+  for (;;) {
+    int n = epoll_wait(w->epoll_fd, events, 64, 100);
+    if (n < 0 && errno != EINTR) {
+      die("epoll_wait(2) failed: %s", strerror(errno));
+    }
+    for (int i = 0; i < n; ++i) {
+      handle_event(w, events[i].data.ptr, events[i].events);
+    }
+    uint64_t now = now_ns();
+    if (now >= deadline) break;
+    if (now >= next_expiry) {
+      expire_requests(w);
+      next_expiry = now + 100000000;
+    }
+  }
+  for (int i = 0; i < w->nconns; ++i) {
+    if (w->conns[i].fd >= 0) close(w->conns[i].fd);
+  }
+  close(w->epoll_fd);
+  return NULL;
+}
+
+static void open_connection(struct Worker* w, struct Connection* conn) {
+  conn->olen = conn->opos = conn->ilen = 0;
+  conn->in_body = 0;
+  conn->head = conn->inflight = 0;
+  conn->fd = socket(server_addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) die("socket(2) failed: %s", strerror(errno));
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  ++w->connects;
+  conn->connecting = 1;
+  if (connect(conn->fd, (struct sockaddr*)&server_addr, server_addrlen) < 0 &&
+      errno != EINPROGRESS) {
+    ++w->connect_errors;
+  }
+  struct epoll_event ev = {EPOLLIN | EPOLLOUT, {.ptr = conn}};
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+    die("epoll_ctl(2) failed: %s", strerror(errno));
+  }
+}
+
+// Drops the connection along with any requests in flight on it and opens a
+// new one in its place.
+static void reset_connection(struct Worker* w, struct Connection* conn) {
+  close(conn->fd);
+  open_connection(w, conn);
+}
+
+static void handle_event(struct Worker* w, struct Connection* conn,
+                         uint32_t events) {
+  if (conn->connecting) {
+    int err = 0;
+    socklen_t len = sizeof err;
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      ++w->connect_errors;
+      reset_connection(w, conn);
+      return;
+    }
+    conn->connecting = 0;
+    fill_pipeline(w, conn);
+  }
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    if (read_responses(w, conn) < 0) {
+      reset_connection(w, conn);
+      return;
+    }
+  }
+  if (flush_requests(w, conn) < 0) {
+    ++w->read_errors;
+    reset_connection(w, conn);
+  }
+}
+
+// Queues requests until the connection has the configured number in flight.
+static void fill_pipeline(struct Worker* w, struct Connection* conn) {
+  uint64_t now = now_ns();
+  while (conn->inflight < pipeline) {
+    const char* path = paths[next_random(&w->rng) % npaths];
+    conn->olen += snprintf(conn->obuf + conn->olen, MAX_REQUEST_SIZE,
+                           "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, host,
+                           extra_headers);
+    conn->sent_at[(conn->head + conn->inflight) % pipeline] = now;
+    ++conn->inflight;
+  }
+}
+
+// Writes out queued requests. Returns -1 if the connection is broken.
+static int flush_requests(struct Worker* w, struct Connection* conn) {
+  (void)w;
+  while (conn->opos < conn->olen) {
+    ssize_t n = send(conn->fd, conn->obuf + conn->opos,
+                     conn->olen - conn->opos, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN) break;
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    conn->opos += n;
+  }
+  int pending = conn->opos < conn->olen;
+  if (!pending) conn->opos = conn->olen = 0;
+  struct epoll_event ev = {EPOLLIN | (pending ? EPOLLOUT : 0), {.ptr = conn}};
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+  return 0;
+}
+
+// Consumes whatever responses have arrived. Returns -1 if the connection has
+// to be replaced.
+static int read_responses(struct Worker* w, struct Connection* conn) {
+  for (;;) {
+    ssize_t n = read(conn->fd, conn->ibuf + conn->ilen,
+                     INPUT_BUF_SIZE - conn->ilen);
+    if (n < 0) {
+      if (errno == EAGAIN) return 0;
+      if (errno == EINTR) continue;
+      ++w->read_errors;
+      return -1;
+    }
+    if (n == 0) {
+      if (conn->inflight) ++w->read_errors;
+      return -1;
+    }
+    w->bytes += n;
+    conn->ilen += n;
+
+    char* p = conn->ibuf;
+    char* end = conn->ibuf + conn->ilen;
+    while (p < end) {
+      if (conn->in_body) {
+        long len = end - p;
+        if (len > conn->body_remaining) len = conn->body_remaining;
+        p += len;
+        conn->body_remaining -= len;
+      } else {
+        int used = parse_header(conn, p, end);
+        if (used < 0) {
+          ++w->read_errors;
+          return -1;
+        }
+        if (used == 0) break;
+        p += used;
+      }
+      if (conn->in_body && conn->body_remaining == 0) {
+        complete_response(w, conn);
+        if (conn->close_after) return -1;
+      }
+    }
+    conn->ilen = end - p;
+    memmove(conn->ibuf, p, conn->ilen);
+    if (conn->ilen == INPUT_BUF_SIZE) {
+      ++w->read_errors;
+      return -1;
+    }
+    fill_pipeline(w, conn);
+  }
+}
+
+// Parses a response header starting at p. Returns its length, 0 if it is not
+// complete yet or -1 if it cannot be handled.
+static int parse_header(struct Connection* conn, char* p, char* end) {
+  char* header_end = memmem(p, end - p, "\r\n\r\n", 4);
+  if (!header_end) return 0;
+  header_end += 4;
+  if (end - p < 12 || strncmp(p, "HTTP/1.", 7)) return -1;
+  conn->status = atoi(p + 9);
+  conn->body_remaining = 0;
+  conn->close_after = p[7] == '0';
+  char* line = memchr(p, '\n', header_end - p) + 1;
+  while (line < header_end - 2) {
+    char* eol = memchr(line, '\n', header_end - line);
+    if (!strncasecmp(line, "Content-Length:", 15)) {
+      conn->body_remaining = atol(line + 15);
+    } else if (!strncasecmp(line, "Connection:", 11)) {
+      char* val = line + 11;
+      while (*val == ' ') ++val;
+      conn->close_after = !strncasecmp(val, "close", 5);
+    } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+      return -1;
+    }
+    line = eol + 1;
+  }
+  if (conn->status == 204 || conn->status == 304) conn->body_remaining = 0;
+  conn->in_body = 1;
+  return header_end - p;
+}
+
+static void complete_response(struct Worker* w, struct Connection* conn) {
+  uint64_t now = now_ns();
+  hist_record(&w->hist, now - conn->sent_at[conn->head]);
+  conn->head = (conn->head + 1) % pipeline;
+  --conn->inflight;
+  conn->in_body = 0;
+  ++w->requests;
+  if (conn->status >= 400) ++w->status_errors;
+}
+
+// Replaces connections whose oldest request has gone unanswered for longer
+// than the timeout.
+static void expire_requests(struct Worker* w) {
+  uint64_t limit = now_ns() - (uint64_t)timeout * 1000000000;
+  for (int i = 0; i < w->nconns; ++i) {
+    struct Connection* conn = &w->conns[i];
+    if (conn->inflight && conn->sent_at[conn->head] < limit) {
+      ++w->timeouts;
+      reset_connection(w, conn);
+    }
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int hist_index(uint64_t value) {
+  int msb = 63 - __builtin_clzll(value | ((2 * HIST_HALF) - 1));
+  int bucket = msb - (HIST_SUB_BITS - 1);
+  int index = bucket * HIST_HALF + (int)(value >> bucket);
+  return index < HIST_SIZE ? index : HIST_SIZE - 1;
+}
+
+// Returns the highest value that maps to the index.
+static uint64_t hist_value(int index) {
+  int bucket = index < 2 * HIST_HALF ? 0 : index / HIST_HALF - 1;
+  uint64_t sub = index - bucket * HIST_HALF;
+  return ((sub + 1) << bucket) - 1;
+}
+
+static void hist_record(struct Histogram* h, uint64_t value) {
+  ++h->counts[hist_index(value)];
+  ++h->total;
+  h->sum += value;
+  if (value < h->min) h->min = value;
+  if (value > h->max) h->max = value;
+}
+
+static void hist_merge(struct Histogram* to, const struct Histogram* from) {
+  for (int i = 0; i < HIST_SIZE; ++i) to->counts[i] += from->counts[i];
+  to->total += from->total;
+  to->sum += from->sum;
+  if (from->min < to->min) to->min = from->min;
+  if (from->max > to->max) to->max = from->max;
+}
+
+static uint64_t hist_percentile(const struct Histogram* h, double percentile) {
+  uint64_t rank = (uint64_t)ceil(percentile / 100 * h->total);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_SIZE; ++i) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t value = hist_value(i);
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void print_report(struct Worker* workers, double elapsed) {
+  struct Worker total;
+  memset(&total, 0, sizeof total);
+  total.hist.min = UINT64_MAX;
+  for (int i = 0; i < thread_count; ++i) {
+    struct Worker* w = &workers[i];
+    hist_merge(&total.hist, &w->hist);
+    total.requests += w->requests;
+    total.bytes += w->bytes;
+    total.connects += w->connects;
+    total.connect_errors += w->connect_errors;
+    total.read_errors += w->read_errors;
+    total.status_errors += w->status_errors;
+    total.timeouts += w->timeouts;
+  }
+  printf("threads: %d, connections: %d, pipeline: %d, duration: %.2fs\n",
+         thread_count, connection_count, pipeline, elapsed);
+  printf("requests: %lu (%.1f/s)\n", total.requests,
+         total.requests / elapsed);
+  printf("transfer: %lu bytes (%.2f MB/s)\n", total.bytes,
+         total.bytes / elapsed / 1e6);
+  printf("connects: %lu\n", total.connects);
+  printf("errors: connect %lu, read %lu, status %lu, timeout %lu\n",
+         total.connect_errors, total.read_errors, total.status_errors,
+         total.timeouts);
+  if (!total.hist.total) return;
+  static const double percentiles[] = {50, 75, 90, 99, 99.9, 99.99};
+  printf("latency (us): min %.1f", total.hist.min / 1e3);
+  for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; ++i) {
+    printf(", p%g %.1f", percentiles[i],
+           hist_percentile(&total.hist, percentiles[i]) / 1e3);
+  }
+  printf(", max %.1f, mean %.1f\n", total.hist.max / 1e3,
+         total.hist.sum / total.hist.total / 1e3);
+  if (print_hdr) print_distribution(&total.hist);
+}
+
+// Prints the distribution in HdrHistogram's percentile output format, with
+// values in milliseconds, so that its plotting tools can read it.
+static void print_distribution(const struct Histogram* h) {
+  printf("\n%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+         "1/(1-Percentile)");
+  uint64_t seen = 0;
+  double sq = 0;
+  double mean = h->sum / h->total;
+  for (int i = 0; i < HIST_SIZE; ++i) {
+    if (!h->counts[i]) continue;
+    seen += h->counts[i];
+    double value = hist_value(i) / 1e6;
+    double p = (double)seen / h->total;
+    double d = hist_value(i) - mean;
+    sq += d * d * h->counts[i];
+    if (seen == h->total) {
+      printf("%12.3f %14.12f %10lu\n", value, p, seen);
+    } else {
+      printf("%12.3f %14.12f %10lu %14.2f\n", value, p, seen, 1 / (1 - p));
+    }
+  }
+  printf("#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e6,
+         sqrt(sq / h->total) / 1e6);
+  printf("#[Max     = %12.3f, Total count    = %12lu]\n", h->max / 1e6,
+         h->total);
+  printf("#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_BUCKETS,
+         2 * HIST_HALF);
+}
+
+static void* xmalloc(size_t sz) {
+  void* p = malloc(sz);
+  if (!p) die("failed to allocate memory");
+  return p;
+}
+
+static void die(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+  exit(1);
+}
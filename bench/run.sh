@@ -0,0 +1,72 @@
+#!/bin/sh
+# Builds myhttpd and loadgen, serves a generated docroot and runs a fixed set
+# of load scenarios against it, printing one summary line per scenario.
+#
+# Usage: bench/run.sh [server options...]
+#
+# Environment: PORT (8089), DURATION seconds per scenario (10), THREADS for
+# loadgen (number of CPUs), OUT directory for binaries, docroot and full
+# reports (bench/out).
+set -e
+
+cd "$(dirname "$0")/.."
+PORT=${PORT:-8089}
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-$(getconf _NPROCESSORS_ONLN)}
+OUT=${OUT:-bench/out}
+
+mkdir -p "$OUT"
+cc -O2 -pthread -o "$OUT/myhttpd" myhttpd.c
+cc -O2 -pthread -o "$OUT/loadgen" bench/loadgen.c -lm
+
+# The docroot is generated once from a fixed seed so that every run serves the
+# same bytes.
+root="$OUT/docroot"
+if [ ! -d "$root" ]; then
+  mkdir -p "$root"
+  for size in 1024 16384 262144 4194304; do
+    awk -v n="$size" 'BEGIN { srand(1); for (i = 0; i < n; ++i)
+      printf "%c", 32 + int(rand() * 95) }' >"$root/$size.txt"
+  done
+  head -c 1048576 /dev/zero >"$root/zero.bin"
+fi
+cat >"$OUT/mix.txt" <<EOF
+# path weight
+/1024.txt 50
+/16384.txt 30
+/262144.txt 15
+/4194304.txt 5
+EOF
+
+"$OUT/myhttpd" --debug --port="$PORT" "$@" "$root" 2>"$OUT/server.log" &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT INT TERM
+sleep 1
+
+# name connections pipeline paths...
+run() {
+  name=$1 connections=$2 pipeline=$3
+  shift 3
+  "$OUT/loadgen" --port="$PORT" --threads="$THREADS" \
+      --connections="$connections" --pipeline="$pipeline" \
+      --duration="$DURATION" --hdr "$@" >"$OUT/$name.txt"
+  awk -v name="$name" '
+    /^requests:/ { rps = $3; gsub(/[(\/s)]/, "", rps) }
+    /^transfer:/ { mbps = $4; gsub(/\(/, "", mbps) }
+    /^errors:/ { errors = $3 + $5 + $7 + $9 }
+    /^latency/ { p50 = $6; p99 = $12; max = $18 }
+    END { printf "%-16s %12s %10s %10s %10s %10s %7d\n",
+                 name, rps, mbps, p50, p99, max, errors }
+  ' "$OUT/$name.txt" | tr -d ,
+}
+
+printf "%-16s %12s %10s %10s %10s %10s %7s\n" \
+    scenario req/s MB/s p50-us p99-us max-us errors
+run small-c1 1 1 /1024.txt
+run small-c64 64 1 /1024.txt
+run small-c64-p16 64 16 /1024.txt
+run medium-c64 64 1 /16384.txt
+run large-c16 16 1 /4194304.txt
+run mix-c64 64 1 --paths="$OUT/mix.txt"
+run mix-c256-gzip 256 1 --paths="$OUT/mix.txt" \
+    --header="Accept-Encoding: gzip"
@@ -1,90 +1,640 @@
 #define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
-struct HTTPHeaderField {
-  char* name;
-  char* value;
-  struct HTTPHeaderField* next;
+// Header fields the server looks at. Others are skipped while parsing.
+enum HeaderField {
+  HEADER_CONTENT_LENGTH,
+  HEADER_HOST,
+  HEADER_RANGE,
+  HEADER_IF_NONE_MATCH,
+  HEADER_CONNECTION,
+  HEADER_ACCEPT_ENCODING,
+  HEADER_IF_RANGE,
+  HEADER_IF_MODIFIED_SINCE,
+  HEADER_TRANSFER_ENCODING,
+  HEADER_EXPECT,
+  HEADER_REFERER,
+  HEADER_USER_AGENT,
+  NUM_HEADER_FIELDS,
 };
 
+// All strings point into the connection's input buffer, where they have been
+// NUL-terminated in place, so parsing a request allocates nothing.
 struct HTTPRequest {
   int protocol_minor_version;
   char* method;
-  char* path;
-  struct HTTPHeaderField* header;
-  char* body;
+  char* path;    // decoded and normalized
+  char* target;  // as sent, for the access log
+  char* header[NUM_HEADER_FIELDS];
   long length;
+  int chunked;
 };
 
 struct FileInfo {
   char* path;
+  int fd;
   long size;
+  time_t mtime;
+  ino_t ino;
   int ok;
 };
 
+// A docroot file shared by every response that serves it. Entries are found
+// through a hash table keyed by URL path, evicted in LRU order and
+// invalidated by inotify events on their directory. Small files are read into
+// memory right behind their header block, and their fd is closed; others keep
+// fd open for sendfile(2). A gzip encoded variant is a separate entry with the
+// same urlpath and name.
+struct CachedFile {
+  char* urlpath;
+  unsigned int hash;
+  int gzip;
+  int no_gzip;
+  char* name;
+  int fd;
+  long size;
+  time_t mtime;
+  // For a gzip variant, the mtime of the file it was made for. A variant
+  // from a precompressed sibling has the sibling's own validators.
+  time_t base_mtime;
+  char etag[64];
+  char last_modified[32];
+  char* content_type;
+  char* header;
+  size_t header_len;
+  char* body;
+  int refs;
+  int cached;
+  struct WatchedDir* dir;
+  struct CachedFile* hash_next;
+  struct CachedFile* lru_prev;
+  struct CachedFile* lru_next;
+  struct CachedFile* dir_prev;
+  struct CachedFile* dir_next;
+};
+
+// Packs bits into bytes least significant bit first, as deflate does.
+struct BitWriter {
+  unsigned char* p;
+  uint32_t bits;
+  int nbits;
+};
+
+// A file name extension and its content type, as read from mime.types.
+// order keeps the first mapping of an extension listed more than once.
+struct MimeType {
+  char* ext;
+  char* type;
+  int order;
+};
+
+struct WatchedDir {
+  int wd;
+  struct CachedFile* files;
+  // Counts the events seen, so that loads started before one are not cached.
+  unsigned long changes;
+  // Loads in flight on the I/O threads, which keep the watch in place.
+  int loads;
+  struct WatchedDir* next;
+};
+
+// A file being opened and read on an I/O thread, or on the ring with
+// io_uring, on behalf of a connection. The thread only sets file or err; the
+// rest belongs to the event loop. Without a urlpath, the job reads a window
+// of the body of file into the page cache instead, ahead of sending it.
+struct FileJob {
+  struct Connection* conn;  // NULL once the connection is gone
+  char* urlpath;
+  struct WatchedDir* dir;
+  unsigned long dir_changes;
+  struct CachedFile* file;
+  int err;
+  int done;
+  struct FileJob* next;
+  off_t offset;
+  off_t len;
+  // With io_uring, what the operations in flight fill in, and how many of
+  // them are yet to complete.
+  struct statx stx;
+  struct open_how how;
+  int fd;
+  int pending;
+};
+
+// A directory entry as returned by getdents64(2).
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// An entry of a directory listing page.
+struct ListingEntry {
+  char* name;
+  int is_dir;
+  long size;
+  time_t mtime;
+};
+
+// An inclusive byte range of a file.
+struct ByteRange {
+  long first;
+  long last;
+};
+
+// A response body held in memory, sent right after the first pos bytes of
+// the connection's output buffer. file, if set, is the cache entry that owns
+// the data.
+struct OutputBody {
+  size_t pos;
+  const char* data;
+  size_t len;
+  struct CachedFile* file;
+};
+
+// Where the decoder is within a request body. Bodies without the chunked
+// transfer coding are a single BODY_DATA run.
+enum BodyState {
+  BODY_DATA,
+  BODY_CHUNK_SIZE,
+  BODY_CHUNK_END,
+  BODY_TRAILER,
+};
+
+// Bump allocator for request-scoped objects, such as file system paths.
+// Everything is released at once by arena_reset() when the next request is
+// parsed. Allocations that do not fit in buf come from heap chunks, which
+// are freed on reset.
+struct Arena {
+  char* buf;
+  size_t used;
+  size_t size;
+  struct ArenaChunk* chunks;
+};
+
+struct ArenaChunk {
+  struct ArenaChunk* next;
+};
+
+// Stages of serving a request, timed for the stats endpoint.
+enum Stage {
+  STAGE_PARSE,       // accept, or arrival of a later request, to parsed
+  STAGE_FIRST_BYTE,  // parsed to first response byte sent
+  STAGE_SEND,        // first response byte to last
+  NUM_STAGES,
+};
+
+// Counters of one worker. The slots of all workers live in shared memory so
+// that whichever worker gets a /__stats request can sum them up. Only the
+// owner writes its slot, with plain relaxed stores.
+struct WorkerStats {
+  _Atomic unsigned long responses[500];  // by status code, from 100
+  _Atomic unsigned long bytes_sent;
+  _Atomic unsigned long connections_accepted;
+  _Atomic unsigned long connections_active;
+  _Atomic unsigned long accept_errors;
+  _Atomic unsigned long cache_memory_hits;
+  _Atomic unsigned long cache_fd_hits;
+  _Atomic unsigned long cache_misses;
+  _Atomic unsigned long access_log_dropped;
+  // Bucket i counts durations under 2^i microseconds; the last one counts
+  // the rest.
+  _Atomic unsigned long latency[NUM_STAGES][24];
+  _Atomic unsigned long latency_usec[NUM_STAGES];
+};
+
+enum ConnectionState {
+  CONN_READING_HEADER,
+  CONN_READING_BODY,
+  CONN_WRITING,
+  // Shut down for writing after the last response, discarding input until
+  // the client closes too.
+  CONN_LINGERING,
+};
+
+struct Connection {
+  int fd;
+  char peer[INET6_ADDRSTRLEN];
+  enum ConnectionState state;
+  uint32_t events;
+  char* docroot;
+  char* ibuf;
+  size_t ipos;
+  size_t ilen;
+  struct HTTPRequest req;
+  struct Arena arena;
+  int nrequests;
+  int keep_alive;
+  time_t last_active;
+  // Monotonic timestamps in microseconds for the stats endpoint: the last
+  // read, the start of the request being read, and the parse and first byte
+  // of the response batch being sent. Zero when not reached yet.
+  long read_at;
+  long request_start;
+  long parsed_at;
+  long first_byte_at;
+  struct Connection* prev;
+  struct Connection* next;
+  char* error_status;
+  // Status code and body length of the last response, for the access log.
+  int response_status;
+  long response_length;
+  enum BodyState body_state;
+  long body_remaining;
+  long body_length;
+  size_t body_floor;
+  int upload_fd;
+  char* upload_path;
+  int upload_error;
+  char* obuf;
+  size_t olen;
+  size_t ocap;
+  struct OutputBody bodies[16];
+  int nbodies;
+  size_t bodies_len;
+  size_t opos;
+  struct CachedFile* file;
+  struct ByteRange* ranges;
+  int nranges;
+  int range_index;
+  int file_fd;
+  off_t file_offset;
+  off_t file_remaining;
+  int use_splice;
+  int pipe_fds[2];
+  size_t pipe_size;
+  size_t piped;
+  // With I/O threads, the part of the file body read in ahead, which is sent
+  // without the event loop waiting for the disk.
+  off_t ready_from;
+  off_t ready_to;
+  // With io_uring, the bits (1 << op) of the UringOps in flight. A closed
+  // connection is only freed once they have all completed.
+  int uring_ops;
+  int closed;
+  // With io_uring, the sendmsg(2) in flight: the kernel reads the message,
+  // and the output it points to, until the send completes.
+  struct msghdr send_msg;
+  struct iovec send_iov[2 * 16 + 1];
+  // The load the response waits for, or whose outcome it is being served
+  // from, and the function that serves it once the load is done.
+  struct FileJob* job;
+  void (*resume)(struct HTTPRequest* req, struct Connection* conn);
+};
+
+// The io_uring instance of a worker. The kernel shares the rings; the tail
+// of the submission queue is published on the next io_uring_enter(2).
+struct Uring {
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned tail;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  // Buffers the kernel picks from for recv(2), so that a connection waiting
+  // for a request needs no input buffer of its own. NULL if the kernel
+  // cannot provide them.
+  struct io_uring_buf_ring* recv_ring;
+  char* recv_bufs;
+  unsigned short recv_tail;
+};
+
+// What an io_uring operation is for. Kept in the low bits of its user_data,
+// next to the connection it is for, if any.
+enum UringOp {
+  URING_ACCEPT,
+  URING_INOTIFY,
+  URING_RECV,
+  URING_POLLOUT,
+  URING_CANCEL,
+  URING_STATX,
+  URING_OPEN,
+  URING_READ,
+  URING_SEND,
+  URING_SPLICE_IN,
+  URING_SPLICE_OUT,
+};
+
 static void log_exit(const char* fmt, ...);
+static void log_error(const char* fmt, ...);
+static void log_info(const char* fmt, ...);
+static void vlog_message(int priority, const char* fmt, va_list ap);
 static void* xmalloc(size_t s);
+static void* arena_alloc(struct Arena* a, size_t size);
+static void arena_reset(struct Arena* a);
 static void install_signal_handlers(void);
 static void trap_signal(int sig, sighandler_t handler);
-static void detach_children(void);
-static void noop_handler(int sig);
-static void signal_exit(int sig);
-static void service(FILE* in, FILE* out, char* docroot);
-static void free_request(struct HTTPRequest* req);
-static struct HTTPRequest* read_request(FILE* in);
-static void read_request_line(struct HTTPRequest* req, FILE* in);
-static struct HTTPHeaderField* read_header_field(FILE* in);
+static void request_stats(int sig);
+static void init_stats(int nslots);
+static void stat_add(_Atomic unsigned long* counter, unsigned long n);
+static void stat_sub(_Atomic unsigned long* counter, unsigned long n);
+static unsigned long stat_load(_Atomic unsigned long* counter);
+static long monotonic_usec(void);
+static void record_latency(enum Stage stage, long usec);
+static void count_sent(struct Connection* conn, size_t n);
+static void request_termination(int sig);
+static void request_log_reopen(int sig);
+static void open_access_log(void);
+static void reopen_access_log(void);
+static void start_access_log(void);
+static void stop_access_log(void);
+static void* drain_access_log(void* arg);
+static void log_access(struct Connection* conn, struct HTTPRequest* req);
+static char* append(char* p, char* end, const char* fmt, ...);
+static char* append_escaped(char* p, char* end, const char* s);
+static void service(struct Connection* conn);
+static int read_request(struct Connection* conn);
+static int read_request_body(struct Connection* conn);
+static void begin_request_body(struct Connection* conn);
+static void store_request_body(struct Connection* conn, char* data,
+                               size_t len);
+static void abort_upload(struct Connection* conn);
+static int is_upload(struct HTTPRequest* req);
+static int is_upload_path(char* path);
+static char* find_header_end(char* buf, size_t len);
+static char* terminate_line(char* eol);
+static void init_scanner(void);
+static char* scan_scalar(char* p, char* end, char a, char b, char c, char d);
+static int read_request_line(struct HTTPRequest* req, char** p, char* end);
+static int normalize_path(char* path);
+static int hex_value(char c);
+static int read_header_field(struct HTTPRequest* req, char** p, char* end);
+static int lookup_header_field(char* name, size_t len);
 static long content_length(struct HTTPRequest* req);
-static char* lookup_header_field_value(struct HTTPRequest* req, char* name);
-static struct FileInfo* get_fileinfo(char* docroot, char* urlpath);
-static void free_fileinfo(struct FileInfo* f);
-static char* build_fspath(char* docroot, char* urlpath);
-static void respond_to(struct HTTPRequest* req, FILE* out, char* docroot);
-static void do_file_response(struct HTTPRequest* req, FILE* out, char* docroot);
-static void method_not_allowed(struct HTTPRequest* req, FILE* out);
-static void not_implemented(struct HTTPRequest* req, FILE* out);
-static void not_found(struct HTTPRequest* req, FILE* out);
-static void output_common_header_fields(struct HTTPRequest* req, FILE* out,
-                                        char* status);
+static int wants_keep_alive(struct HTTPRequest* req);
+static int is_digit(char c);
+static int accepts_gzip(struct HTTPRequest* req);
+static int parse_ranges(char* val, long size, struct ByteRange* ranges,
+                        int max);
+static int if_range_matches(struct HTTPRequest* req, struct CachedFile* f);
+static time_t parse_http_date(char* val);
+static void format_http_date(char* buf, size_t size, time_t t);
+static void format_etag(char* buf, size_t size, ino_t ino, long len,
+                        time_t mtime);
+static void format_gzip_etag(char* buf, size_t size, const char* etag);
+static int etag_matches(char* val, const char* etag);
+static void get_fileinfo(struct FileInfo* info, char* urlpath);
+static int check_file_type(int fd, struct stat* st);
+static int file_type_error(mode_t mode);
+static void open_docroot(void);
+static const char* docroot_relative(const char* urlpath);
+static int open_beneath(const char* urlpath, int flags, mode_t mode);
+static char* escape_path(struct Arena* arena, const char* path);
+static void init_file_cache(void);
+static struct CachedFile* open_cached_file(struct Arena* arena, char* docroot,
+                                           char* urlpath);
+static struct CachedFile* open_gzip_file(struct Arena* arena, char* docroot,
+                                         char* urlpath,
+                                         struct CachedFile* base);
+static struct CachedFile* load_file(char* urlpath);
+static struct CachedFile* new_file_entry(struct FileInfo* info);
+static struct CachedFile* lookup_cached_file(char* urlpath, int gzip);
+static struct CachedFile* find_cached_file(char* urlpath, int gzip);
+static struct CachedFile* new_cached_file(char* urlpath, int gzip, long size,
+                                          time_t mtime, const char* etag,
+                                          char* content_type, int in_memory);
+static void fill_cached_file(struct CachedFile* f, struct FileInfo* info);
+static void insert_cached_file(struct CachedFile* f, struct WatchedDir* dir);
+static void release_cached_file(struct CachedFile* f);
+static void evict_cached_file(struct CachedFile* f);
+static void prune_watched_dirs(void);
+static void shrink_file_cache(void);
+static void log_cache_stats(void);
+static struct WatchedDir* watch_directory(struct Arena* arena, char* docroot,
+                                          char* urlpath);
+static struct CachedFile* open_directory_listing(struct Arena* arena,
+                                                 char* docroot,
+                                                 char* urlpath);
+static int render_directory_listing(int fd, char* urlpath, FILE* out);
+static int compare_listing_entries(const void* a, const void* b);
+static void output_html_escaped(FILE* out, const char* s);
+static void output_url_escaped(FILE* out, const char* s);
+static void handle_file_events(void);
+static void start_file_jobs(void);
+static void* run_file_jobs(void* arg);
+static struct CachedFile* open_file(struct Connection* conn, char* urlpath);
+static void start_file_job(struct Connection* conn, char* urlpath);
+static void finish_file_jobs(void);
+static void complete_file_job(struct FileJob* job);
+static void queue_file_job(struct FileJob* job);
+static void start_read_ahead(struct Connection* conn);
+static void read_ahead(struct FileJob* job);
+static void finish_read_ahead(struct FileJob* job);
+static int waiting_for_file(struct Connection* conn);
+static void drop_file_job(struct Connection* conn);
+static void resume_request(struct Connection* conn);
+static int affects_cached_file(struct CachedFile* f, const char* name);
+static int is_compressible(const char* content_type);
+static long gzip_compress(const unsigned char* src, long len,
+                          unsigned char* dst, time_t mtime);
+static void put_bits(struct BitWriter* w, uint32_t value, int n);
+static void put_code(struct BitWriter* w, uint32_t code, int n);
+static void put_symbol(struct BitWriter* w, int sym);
+static void put_match(struct BitWriter* w, int len, int dist);
+static uint32_t gzip_crc32(const unsigned char* p, long len);
+static void respond_to(struct HTTPRequest* req, struct Connection* conn);
+static void do_file_response(struct HTTPRequest* req, struct Connection* conn);
+static void do_directory_response(struct HTTPRequest* req,
+                                  struct Connection* conn);
+static void serve_file(struct HTTPRequest* req, struct Connection* conn,
+                       char* urlpath, struct CachedFile* f);
+static void file_error(struct HTTPRequest* req, struct Connection* conn,
+                       char* urlpath);
+static int do_not_modified_response(struct HTTPRequest* req,
+                                    struct Connection* conn, char* urlpath);
+static void do_range_response(struct HTTPRequest* req, struct Connection* conn,
+                              struct CachedFile* f, struct ByteRange* ranges,
+                              int nranges);
+static void output_next_range(struct Connection* conn);
+static void do_upload_response(struct HTTPRequest* req,
+                               struct Connection* conn);
+static void do_stats_response(struct HTTPRequest* req,
+                              struct Connection* conn);
+static void output_stats(FILE* out);
+static void method_not_allowed(struct HTTPRequest* req,
+                               struct Connection* conn);
+static void not_implemented(struct HTTPRequest* req, struct Connection* conn);
+static void not_found(struct HTTPRequest* req, struct Connection* conn);
+static void moved_permanently(struct HTTPRequest* req, struct Connection* conn);
+static void forbidden(struct HTTPRequest* req, struct Connection* conn);
+static void internal_error(struct HTTPRequest* req, struct Connection* conn);
+static void output_common_header_fields(struct HTTPRequest* req,
+                                        struct Connection* conn, char* status);
+static void render_common_header_fields(void);
+static void output(struct Connection* conn, const char* fmt, ...);
+static void output_bytes(struct Connection* conn, const char* data, size_t len);
+static void output_body(struct Connection* conn, const char* data, size_t len,
+                        struct CachedFile* file);
+static int output_full(struct Connection* conn);
+static void load_mime_types(const char* path);
+static void add_mime_types(char* line);
+static int compare_mime_types(const void* a, const void* b);
 static char* guess_content_type(struct FileInfo* f);
 static void upcase(char* str);
-static int listen_socket(char* path);
+static int listen_socket(char* port, int reuseport);
+static int bind_listener(struct addrinfo* ai, int reuseport);
+static void open_netstat(void);
+static int read_listen_drops(unsigned long* overflows, unsigned long* drops);
+static void supervise_workers(int* server_fds, char* doc_root);
+static pid_t spawn_worker(int index, int* server_fds, char* doc_root,
+                          sigset_t* mask);
+static void pin_to_cpu(int index);
 static void server_main(int server_fd, char* doc_root);
+static void handle_signal_requests(void);
+static int init_uring(void);
+static void init_recv_buffers(void);
+static void provide_recv_buffer(unsigned short bid);
+static void uring_main(int server_fd, char* doc_root);
+static void handle_completion(struct io_uring_cqe* cqe, int server_fd,
+                              char* doc_root);
+static struct io_uring_sqe* get_sqe(int op, void* ptr);
+static int enter_uring(int wait, int timeout);
+static void uring_accept(int server_fd);
+static void uring_poll(int fd, int op, void* ptr, uint32_t events,
+                       int multishot);
+static int watch_connection_uring(struct Connection* conn, uint32_t events);
+static void uring_recv(struct Connection* conn, int select);
+static void uring_sendmsg(struct Connection* conn, int flags);
+static int uring_sending(struct Connection* conn);
+static void handle_sent(struct Connection* conn, int op, int res);
+static void uring_load_file(struct FileJob* job);
+static void handle_load_completion(struct FileJob* job, int op, int res);
+static void set_nonblocking(int fd);
+static void accept_connections(int server_fd, char* doc_root);
+static void count_accept_error(int server_fd, int err);
+static void resume_accepting(int server_fd);
+static void start_connection(int sock, struct sockaddr_storage* addr,
+                             char* doc_root);
+static struct Connection* new_connection(int fd, char* doc_root);
+static void close_connection(struct Connection* conn);
+static void free_connection(struct Connection* conn);
+static int watch_connection(struct Connection* conn, uint32_t events);
+static void touch_connection(struct Connection* conn);
+static void expire_connections(void);
+static void handle_readable(struct Connection* conn);
+static int make_input_room(struct Connection* conn);
+static void handle_received(struct Connection* conn, ssize_t n);
+static void process_input(struct Connection* conn);
+static void reject_request(struct Connection* conn, char* status);
+static void handle_writable(struct Connection* conn);
+static int write_response(struct Connection* conn);
+static int gather_output(struct Connection* conn, struct iovec* iov);
+static void clear_output(struct Connection* conn);
+static int finish_response(struct Connection* conn);
+static void linger_connection(struct Connection* conn);
+static void wait_for_output(struct Connection* conn);
+static int send_file_body(struct Connection* conn);
+static off_t ready_body_len(struct Connection* conn);
+static int splice_file_body(struct Connection* conn);
+static int uring_send_file(struct Connection* conn);
+static void close_file_body(struct Connection* conn);
 static void become_daemon(void);
 static void setup_environment(char* root, char* user, char* group);
 
 static const char* USAGE =
-    "Usage: %s [--port=n] [--chroot --user=u --group=g] <docroot>\n";
+    "Usage: %s [--port=n] [--workers=n] [--cache-max-file=bytes] "
+    "[--cache-memory=bytes] [--mime-types=file] [--upload] "
+    "[--max-body=bytes] [--access-log=file] [--autoindex] [--io-uring] "
+    "[--io-threads=n] [--backlog=n] [--defer-accept=seconds] "
+    "[--fastopen=n] [--chroot --user=u --group=g] <docroot>\n";
 
 static int debug_mode = 0;
+static int upload_enabled = 0;
+static int autoindex_enabled = 0;
+static int use_io_uring = 0;
 static int do_chroot = 0;
 static char* user = NULL;
 static char* group = NULL;
 static char* port = NULL;
 static char* docroot = NULL;
+static int docroot_fd = -1;
+static int worker_count = 0;
+static int io_threads = 4;
+static long cache_max_file_size = 16384;
+static long cache_memory_limit = 64L << 20;
+static char* mime_types_path = "/etc/mime.types";
+static long max_body_size = 1L << 30;
+static char* access_log_path = NULL;
+static int listen_backlog = SOMAXCONN;
+static int defer_accept = 0;
+static int fastopen_queue = 0;
+// /proc/net/netstat, opened before a chroot hides it.
+static int netstat_fd = -1;
+
+// Updated once per event loop iteration.
+static time_t current_time;
+
+// When the listening socket was set aside for lack of descriptors, or 0.
+static time_t accept_paused = 0;
+
+// One slot per worker, shared between them, and the slot of this process.
+static struct WorkerStats* worker_stats = NULL;
+static int nstats_slots = 0;
+static struct WorkerStats* stats = NULL;
 
 static struct option longopts[] = {
     {"debug", no_argument, &debug_mode, 1},
+    {"upload", no_argument, &upload_enabled, 1},
+    {"autoindex", no_argument, &autoindex_enabled, 1},
+    {"io-uring", no_argument, &use_io_uring, 1},
     {"chroot", no_argument, NULL, 'c'},
     {"user", required_argument, NULL, 'u'},
     {"group", required_argument, NULL, 'g'},
     {"port", required_argument, NULL, 'p'},
+    {"workers", required_argument, NULL, 'w'},
+    {"cache-max-file", required_argument, NULL, 'f'},
+    {"cache-memory", required_argument, NULL, 'm'},
+    {"mime-types", required_argument, NULL, 't'},
+    {"max-body", required_argument, NULL, 'b'},
+    {"access-log", required_argument, NULL, 'a'},
+    {"io-threads", required_argument, NULL, 'i'},
+    {"backlog", required_argument, NULL, 'q'},
+    {"defer-accept", required_argument, NULL, 'd'},
+    {"fastopen", required_argument, NULL, 'o'},
     {"help", no_argument, NULL, 'h'},
     {0, 0, 0, 0},
 };
@@ -109,6 +659,68 @@ int main(int argc, char* argv[]) {
       case 'p':
         port = optarg;
         break;
+      case 'w':
+        worker_count = atoi(optarg);
+        if (worker_count < 1) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
+      case 'f':
+        cache_max_file_size = atol(optarg);
+        if (cache_max_file_size < 0) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
+      case 'm':
+        cache_memory_limit = atol(optarg);
+        if (cache_memory_limit < 0) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
+      case 't':
+        mime_types_path = optarg;
+        break;
+      case 'a':
+        access_log_path = optarg;
+        break;
+      case 'i':
+        io_threads = atoi(optarg);
+        if (io_threads < 0) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
+      case 'q':
+        listen_backlog = atoi(optarg);
+        if (listen_backlog <= 0) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
+      case 'd':
+        defer_accept = atoi(optarg);
+        if (defer_accept < 0) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
+      case 'o':
+        fastopen_queue = atoi(optarg);
+        if (fastopen_queue < 0) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
+      case 'b':
+        max_body_size = atol(optarg);
+        if (max_body_size < 0) {
+          fprintf(stderr, USAGE, argv[0]);
+          exit(1);
+        }
+        break;
       case 'h':
         fprintf(stdout, USAGE, argv[0]);
         exit(0);
@@ -122,31 +734,67 @@ int main(int argc, char* argv[]) {
     exit(1);
   }
   docroot = argv[optind];
+  load_mime_types(mime_types_path);
+  // Loaded now, as neither is reachable after chroot.
+  tzset();
+  if (access_log_path) open_access_log();
+  open_netstat();
   if (do_chroot) {
     setup_environment(docroot, user, group);
     docroot = "";
   }
+  open_docroot();
   install_signal_handlers();
-  int server_fd = listen_socket(port);
+  init_scanner();
+  int nsockets = worker_count ? worker_count : 1;
+  init_stats(nsockets);
+  int* server_fds = xmalloc(sizeof(int) * nsockets);
+  for (int i = 0; i < nsockets; ++i) {
+    server_fds[i] = listen_socket(port, worker_count > 0);
+  }
   if (!debug_mode) {
     openlog(SERVER_NAME, LOG_PID | LOG_NDELAY, LOG_DAEMON);
     become_daemon();
   }
-  server_main(server_fd, docroot);
+  if (worker_count) {
+    supervise_workers(server_fds, docroot);
+  } else {
+    server_main(server_fds[0], docroot);
+  }
   exit(0);
 }
 
 static void log_exit(const char* fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
+  vlog_message(LOG_ERR, fmt, ap);
+  va_end(ap);
+  exit(1);
+}
+
+// Logs like log_exit() but keeps the process running. Used for errors that
+// only concern a single connection.
+static void log_error(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vlog_message(LOG_ERR, fmt, ap);
+  va_end(ap);
+}
+
+static void log_info(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vlog_message(LOG_INFO, fmt, ap);
+  va_end(ap);
+}
+
+static void vlog_message(int priority, const char* fmt, va_list ap) {
   if (debug_mode) {
     vfprintf(stderr, fmt, ap);
     fputc('\n', stderr);
   } else {
-    vsyslog(LOG_ERR, fmt, ap);
+    vsyslog(priority, fmt, ap);
   }
-  va_end(ap);
-  exit(1);
 }
 
 static void* xmalloc(size_t s) {
@@ -155,9 +803,38 @@ static void* xmalloc(size_t s) {
   return p;
 }
 
+static const size_t ARENA_SIZE = 2048;
+static const size_t ARENA_ALIGN = 16;
+
+static void* arena_alloc(struct Arena* a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (a->size - a->used >= size) {
+    void* p = a->buf + a->used;
+    a->used += size;
+    return p;
+  }
+  struct ArenaChunk* c = xmalloc(ARENA_ALIGN + size);
+  c->next = a->chunks;
+  a->chunks = c;
+  return (char*)c + ARENA_ALIGN;
+}
+
+static void arena_reset(struct Arena* a) {
+  while (a->chunks) {
+    struct ArenaChunk* next = a->chunks->next;
+    free(a->chunks);
+    a->chunks = next;
+  }
+  a->used = 0;
+}
+
+// A client going away must not kill the process: writes to its socket fail
+// with EPIPE instead.
 static void install_signal_handlers(void) {
-  trap_signal(SIGPIPE, signal_exit);
-  detach_children();
+  trap_signal(SIGPIPE, SIG_IGN);
+  trap_signal(SIGUSR1, request_stats);
+  trap_signal(SIGHUP, request_log_reopen);
+  trap_signal(SIGTERM, request_termination);
 }
 
 static void trap_signal(int sig, sighandler_t handler) {
@@ -170,287 +847,4022 @@ static void trap_signal(int sig, sighandler_t handler) {
   }
 }
 
-static void detach_children(void) {
-  struct sigaction act;
-  act.sa_handler = noop_handler;
-  sigemptyset(&act.sa_mask);
-  act.sa_flags = SA_RESTART | SA_NOCLDWAIT;
-  if (sigaction(SIGCHLD, &act, NULL) < 0) {
-    log_exit("sigaction() failed: %s", strerror(errno));
+// Set by SIGUSR1, which asks the event loop to log its cache counters.
+static volatile sig_atomic_t stats_requested = 0;
+
+static void request_stats(int sig) {
+  stats_requested = 1;
+}
+
+// Set by SIGTERM, which makes the event loop flush the access log and exit.
+static volatile sig_atomic_t terminate_requested = 0;
+
+static void request_termination(int sig) {
+  terminate_requested = 1;
+}
+
+static const int MAX_KEEPALIVE_REQUESTS = 100;
+
+// Maps the stats slots before any worker is forked so that they all share
+// them. The first slot is used until a worker switches to its own.
+static void init_stats(int nslots) {
+  worker_stats = mmap(NULL, sizeof(struct WorkerStats) * nslots,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                      0);
+  if (worker_stats == MAP_FAILED) {
+    log_exit("mmap(2) failed: %s", strerror(errno));
+  }
+  nstats_slots = nslots;
+  stats = worker_stats;
+}
+
+// The owner is the only writer of a counter, so a relaxed load and store do
+// without a locked instruction; they only keep readers from seeing a torn
+// value.
+static void stat_add(_Atomic unsigned long* counter, unsigned long n) {
+  atomic_store_explicit(counter, stat_load(counter) + n, memory_order_relaxed);
+}
+
+static void stat_sub(_Atomic unsigned long* counter, unsigned long n) {
+  atomic_store_explicit(counter, stat_load(counter) - n, memory_order_relaxed);
+}
+
+static unsigned long stat_load(_Atomic unsigned long* counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static long monotonic_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void record_latency(enum Stage stage, long usec) {
+  int nbuckets = sizeof stats->latency[0] / sizeof stats->latency[0][0];
+  int i = 0;
+  while (i < nbuckets - 1 && usec >> i > 0) ++i;
+  stat_add(&stats->latency[stage][i], 1);
+  stat_add(&stats->latency_usec[stage], usec > 0 ? usec : 0);
+}
+
+// Accounts for n response bytes handed to the socket. Responses to
+// pipelined requests that go out together are timed as one batch from the
+// first of them.
+static void count_sent(struct Connection* conn, size_t n) {
+  stat_add(&stats->bytes_sent, n);
+  if (conn->parsed_at && !conn->first_byte_at) {
+    conn->first_byte_at = monotonic_usec();
+    record_latency(STAGE_FIRST_BYTE, conn->first_byte_at - conn->parsed_at);
+  }
+}
+
+// Access log lines are formatted by the event loop into a per-worker ring
+// and written out in batches by a thread of their own, so serving a request
+// never waits for the disk. Lines that do not fit in the ring are dropped and
+// counted.
+static const size_t ACCESS_LOG_RING_SIZE = 4 << 20;
+static const long ACCESS_LOG_FLUSH_NSEC = 20000000;
+
+static int access_log_fd = -1;
+static char* access_log_ring = NULL;
+static _Atomic size_t access_log_head = 0;  // advanced by the event loop
+static _Atomic size_t access_log_tail = 0;  // advanced by the drainer
+static _Atomic int access_log_reopen = 0;
+static _Atomic int access_log_closing = 0;
+static pthread_t access_log_thread;
+
+// Log timestamps, rendered once per second.
+static char access_log_time[32];
+static time_t access_log_time_at = -1;
+
+// Set by SIGHUP, after the log has been rotated.
+static void request_log_reopen(int sig) {
+  atomic_store(&access_log_reopen, 1);
+}
+
+// Opens the log before chroot. Its path is made absolute for reopening, which
+// after chroot only works if the log is inside the new root.
+static void open_access_log(void) {
+  if (access_log_path[0] != '/') {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof cwd)) {
+      log_exit("getcwd(3) failed: %s", strerror(errno));
+    }
+    size_t len = strlen(cwd) + strlen(access_log_path) + 2;
+    char* path = xmalloc(len);
+    snprintf(path, len, "%s/%s", cwd, access_log_path);
+    access_log_path = path;
+  }
+  reopen_access_log();
+  if (access_log_fd < 0) exit(1);
+}
+
+// Keeps writing to the old file if the path cannot be opened.
+static void reopen_access_log(void) {
+  int fd = open(access_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    log_error("%s: %s", access_log_path, strerror(errno));
+    return;
+  }
+  if (access_log_fd < 0) {
+    access_log_fd = fd;
+    return;
   }
+  dup3(fd, access_log_fd, O_CLOEXEC);
+  close(fd);
+}
+
+// Runs in each worker, as threads do not survive fork(2). The drainer blocks
+// every signal so that they keep interrupting the event loop.
+static void start_access_log(void) {
+  if (!access_log_path) return;
+  access_log_ring = xmalloc(ACCESS_LOG_RING_SIZE);
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&access_log_thread, NULL, drain_access_log, NULL);
+  if (err) log_exit("pthread_create(3) failed: %s", strerror(err));
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Waits until the lines logged so far have been written.
+static void stop_access_log(void) {
+  if (!access_log_ring) return;
+  atomic_store(&access_log_closing, 1);
+  pthread_join(access_log_thread, NULL);
 }
 
-static void noop_handler(int sig) {
-  ;
+static void* drain_access_log(void* arg) {
+  int failing = 0;
+  for (;;) {
+    if (atomic_exchange(&access_log_reopen, 0)) reopen_access_log();
+    int closing = atomic_load(&access_log_closing);
+    size_t tail = atomic_load_explicit(&access_log_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&access_log_head, memory_order_acquire);
+    while (tail != head) {
+      // Where the ring wraps, both parts go out with one writev(2), as the
+      // workers share the O_APPEND file and another one's write could land
+      // between them, in the middle of a line.
+      size_t pos = tail % ACCESS_LOG_RING_SIZE;
+      size_t len = head - tail;
+      struct iovec iov[2];
+      iov[0].iov_base = access_log_ring + pos;
+      iov[0].iov_len = len < ACCESS_LOG_RING_SIZE - pos
+                           ? len
+                           : ACCESS_LOG_RING_SIZE - pos;
+      iov[1].iov_base = access_log_ring;
+      iov[1].iov_len = len - iov[0].iov_len;
+      ssize_t n = writev(access_log_fd, iov, iov[1].iov_len ? 2 : 1);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        if (!failing) {
+          log_error("failed to write access log: %s", strerror(errno));
+        }
+        failing = 1;
+        n = len;
+      } else {
+        failing = 0;
+      }
+      tail += n;
+      atomic_store_explicit(&access_log_tail, tail, memory_order_release);
+    }
+    if (closing) return NULL;
+    struct timespec interval = {0, ACCESS_LOG_FLUSH_NSEC};
+    nanosleep(&interval, NULL);
+  }
 }
 
-static void signal_exit(int sig) {
-  log_exit("exit by signal %d", sig);
+// Appends a line in the Combined Log Format. req is NULL for requests that
+// were rejected before they could be parsed.
+static void log_access(struct Connection* conn, struct HTTPRequest* req) {
+  if (!access_log_ring) return;
+  if (access_log_time_at != current_time) {
+    struct tm tm;
+    localtime_r(&current_time, &tm);
+    strftime(access_log_time, sizeof access_log_time, "%d/%b/%Y:%H:%M:%S %z",
+             &tm);
+    access_log_time_at = current_time;
+  }
+  char line[4096];
+  char* end = line + sizeof line - 1;  // leaves room for the newline
+  char* p = append(line, end, "%s - - [%s] \"", conn->peer, access_log_time);
+  if (req) {
+    p = append_escaped(p, end, req->method);
+    p = append(p, end, " ");
+    p = append_escaped(p, end, req->target);
+    p = append(p, end, " HTTP/1.%d", req->protocol_minor_version);
+  } else {
+    p = append(p, end, "-");
+  }
+  p = append(p, end, "\" %d ", conn->response_status);
+  if (conn->response_length > 0) {
+    p = append(p, end, "%ld \"", conn->response_length);
+  } else {
+    p = append(p, end, "- \"");
+  }
+  p = append_escaped(p, end, req ? req->header[HEADER_REFERER] : NULL);
+  p = append(p, end, "\" \"");
+  p = append_escaped(p, end, req ? req->header[HEADER_USER_AGENT] : NULL);
+  p = append(p, end, "\"");
+  *p++ = '\n';
+
+  size_t len = p - line;
+  size_t head = atomic_load_explicit(&access_log_head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&access_log_tail, memory_order_acquire);
+  if (ACCESS_LOG_RING_SIZE - (head - tail) < len) {
+    stat_add(&stats->access_log_dropped, 1);
+    return;
+  }
+  size_t pos = head % ACCESS_LOG_RING_SIZE;
+  size_t first = len < ACCESS_LOG_RING_SIZE - pos ? len
+                                                  : ACCESS_LOG_RING_SIZE - pos;
+  memcpy(access_log_ring + pos, line, first);
+  memcpy(access_log_ring, line + first, len - first);
+  atomic_store_explicit(&access_log_head, head + len, memory_order_release);
 }
 
-static void service(FILE* in, FILE* out, char* docroot) {
-  struct HTTPRequest* req = read_request(in);
-  respond_to(req, out, docroot);
-  free_request(req);
+// Formats into [p, end), truncating if need be. Returns the new end of the
+// string.
+static char* append(char* p, char* end, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(p, end - p, fmt, ap);
+  va_end(ap);
+  if (n < 0) return p;
+  return p + (n < end - p ? n : end - p - 1);
 }
 
-static void free_request(struct HTTPRequest* req) {
-  for (struct HTTPHeaderField* h = req->header; h;) {
-    struct HTTPHeaderField* next = h->next;
-    free(h->name);
-    free(h->value);
-    free(h);
-    h = next;
+// Like append(), but escapes the characters that would let a client forge
+// fields or lines. An empty or missing string is logged as "-".
+static char* append_escaped(char* p, char* end, const char* s) {
+  if (!s || !*s) s = "-";
+  for (; *s && end - p > 4; ++s) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\' || c < 0x20 || c >= 0x7f) {
+      p += sprintf(p, "\\x%02x", c);
+    } else {
+      *p++ = c;
+    }
   }
-  free(req->method);
-  free(req->path);
-  free(req->body);
+  *p = '\0';
+  return p;
+}
+
+static void service(struct Connection* conn) {
+  conn->keep_alive = wants_keep_alive(&conn->req) &&
+                     ++conn->nrequests < MAX_KEEPALIVE_REQUESTS;
+  respond_to(&conn->req, conn);
+  // Otherwise logged by resume_request().
+  if (!waiting_for_file(conn)) log_access(conn, &conn->req);
 }
 
-static const int MAX_REQUEST_BODY_LENGTH = 1024;
+static const size_t INPUT_BUF_SIZE = 8192;
 
-static struct HTTPRequest* read_request(FILE* in) {
-  struct HTTPRequest* req = xmalloc(sizeof(struct HTTPRequest));
-  read_request_line(req, in);
-  req->header = NULL;
-  struct HTTPHeaderField* h;
-  while ((h = read_header_field(in))) {
-    h->next = req->header;
-    req->header = h;
+// Parses the request header once it has been fully buffered in conn->ibuf.
+// Returns 0 if more input is needed, 1 if conn->req has been set up and -1 if
+// the request is to be rejected with conn->error_status. Input following the
+// request is left in conn->ibuf for the next pipelined request.
+static int read_request(struct Connection* conn) {
+  // Input already buffered arrived with the last read at the latest.
+  if (!conn->request_start) conn->request_start = conn->read_at;
+  char* start = conn->ibuf + conn->ipos;
+  char* end = find_header_end(start, conn->ilen - conn->ipos);
+  if (!end) {
+    if (conn->ilen - conn->ipos == INPUT_BUF_SIZE) {
+      log_error("request header too long");
+      conn->error_status = "431 Request Header Fields Too Large";
+      return -1;
+    }
+    return 0;
+  }
+  arena_reset(&conn->arena);
+  struct HTTPRequest* req = &conn->req;
+  memset(req, 0, sizeof *req);
+
+  conn->error_status = "400 Bad Request";
+  char* p = start;
+  if (read_request_line(req, &p, end) < 0) return -1;
+  req->target = req->path;
+  if (access_log_path) {
+    req->target = arena_alloc(&conn->arena, strlen(req->path) + 1);
+    strcpy(req->target, req->path);
+  }
+  if (normalize_path(req->path) < 0) {
+    log_error("bad request target: %s", req->target);
+    return -1;
   }
-  req->length = content_length(req);
-  if (req->length == 0) {
-    req->body = NULL;
-    return req;
+  while (*p != '\n' && !(p[0] == '\r' && p[1] == '\n')) {
+    if (read_header_field(req, &p, end) < 0) return -1;
+  }
+  char* coding = req->header[HEADER_TRANSFER_ENCODING];
+  if (coding) {
+    if (req->header[HEADER_CONTENT_LENGTH]) {
+      log_error("both Transfer-Encoding and Content-Length in request");
+      return -1;
+    }
+    if (strcasecmp(coding, "chunked")) {
+      log_error("unsupported transfer coding: %s", coding);
+      conn->error_status = "501 Not Implemented";
+      return -1;
+    }
+    req->chunked = 1;
+    req->length = -1;
+  } else {
+    req->length = content_length(req);
+    if (req->length < 0) {
+      log_error("invalid Content-Length: %s",
+                req->header[HEADER_CONTENT_LENGTH]);
+      return -1;
+    }
+    if (req->length > max_body_size) {
+      log_error("request body too long");
+      conn->error_status = "413 Content Too Large";
+      return -1;
+    }
   }
+  long now = monotonic_usec();
+  record_latency(STAGE_PARSE, now - conn->request_start);
+  conn->request_start = 0;
+  if (!conn->parsed_at) conn->parsed_at = now;
+  conn->body_length = 0;
+  conn->ipos = conn->body_floor = end - conn->ibuf;
+  conn->body_state = req->chunked ? BODY_CHUNK_SIZE : BODY_DATA;
+  conn->body_remaining = req->chunked ? 0 : req->length;
+  return 1;
+}
 
-  if (req->length > MAX_REQUEST_BODY_LENGTH) {
-    log_exit("request body too long");
+// Decodes percent escapes in the request target, then drops its query and
+// removes empty and dot segments (RFC 3986 5.2.4), all in place; ".." stops
+// at the root. File lookups rely on the result having no such segments.
+// Returns -1 for a target that is not an absolute path or that contains an
+// encoded NUL or a bad escape.
+static int normalize_path(char* path) {
+  if (*path != '/') return -1;
+  char* w = path;
+  for (char* r = path; *r && *r != '?'; ++r) {
+    char c = *r;
+    if (c == '%') {
+      int hi = hex_value(r[1]);
+      int lo = hi < 0 ? -1 : hex_value(r[2]);
+      if (lo < 0 || (hi | lo) == 0) return -1;
+      c = hi << 4 | lo;
+      r += 2;
+    }
+    *w++ = c;
   }
-  req->body = xmalloc(req->length);
-  if (fread(req->body, req->length, 1, in) < 1) {
-    log_exit("failed to read request body");
+  *w = '\0';
+  // Segments are copied down to w, each with its leading slash; a path that
+  // ends on an empty or dot segment keeps a trailing slash.
+  w = path;
+  int trailing_slash = 0;
+  for (char* r = path; *r;) {
+    char* seg = r + 1;
+    size_t n = strcspn(seg, "/");
+    trailing_slash = n == 0 || (n == 1 && seg[0] == '.') ||
+                     (n == 2 && seg[0] == '.' && seg[1] == '.');
+    if (n == 2 && trailing_slash) {
+      while (w > path && *--w != '/') continue;
+    } else if (!trailing_slash) {
+      *w++ = '/';
+      memmove(w, seg, n);
+      w += n;
+    }
+    r = seg + n;
   }
-  return req;
+  if (w == path || trailing_slash) *w++ = '/';
+  *w = '\0';
+  return 0;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
 }
 
-static const size_t LINE_BUF_SIZE = 1024;
+// Decodes the request body buffered in conn->ibuf and passes it on with
+// store_request_body(). The body is never held as a whole: the part of the
+// input buffer past the header, from conn->body_floor on, is reused as it is
+// consumed, and the socket is not read while it is full, so a large body
+// costs no more memory than a small one. Returns the same values
+// as read_request().
+static int read_request_body(struct Connection* conn) {
+  for (;;) {
+    char* p = conn->ibuf + conn->ipos;
+    size_t avail = conn->ilen - conn->ipos;
+    if (conn->body_state == BODY_DATA) {
+      if (conn->body_remaining == 0) {
+        if (!conn->req.chunked) return 1;
+        conn->body_state = BODY_CHUNK_END;
+        continue;
+      }
+      if (avail == 0) return 0;
+      size_t n = avail < (size_t)conn->body_remaining ? avail
+                                                      : conn->body_remaining;
+      store_request_body(conn, p, n);
+      conn->ipos += n;
+      conn->body_remaining -= n;
+      continue;
+    }
+    if (conn->body_state == BODY_CHUNK_END) {
+      size_t len = avail > 0 && *p == '\n' ? 1 : 2;
+      if (avail < len) return 0;
+      if (len == 2 && (p[0] != '\r' || p[1] != '\n')) {
+        log_error("malformed chunk");
+        conn->error_status = "400 Bad Request";
+        return -1;
+      }
+      conn->ipos += len;
+      conn->body_state = BODY_CHUNK_SIZE;
+      continue;
+    }
+    char* eol = memchr(p, '\n', avail);
+    if (!eol) {
+      if (avail == INPUT_BUF_SIZE) {
+        log_error("chunk header too long");
+        conn->error_status = "400 Bad Request";
+        return -1;
+      }
+      return 0;
+    }
+    conn->ipos = eol + 1 - conn->ibuf;
+    if (conn->body_state == BODY_TRAILER) {
+      // Trailer fields are skipped up to the empty line ending the body.
+      if (eol == p || (eol == p + 1 && *p == '\r')) return 1;
+      continue;
+    }
+    long size = 0;
+    char* q = p;
+    for (; hex_value(*q) >= 0; ++q) {
+      if (size > max_body_size) break;
+      size = size * 16 + hex_value(*q);
+    }
+    // A size past the limit stops the parse short of the delimiter, and is
+    // rejected as too long below. NUL is not a delimiter, though strchr(3)
+    // finds it.
+    if (q == p ||
+        (size <= max_body_size && (!*q || !strchr(" \t;\r\n", *q)))) {
+      log_error("malformed chunk size");
+      conn->error_status = "400 Bad Request";
+      return -1;
+    }
+    conn->body_length += size;
+    if (size > max_body_size || conn->body_length > max_body_size) {
+      log_error("request body too long");
+      conn->error_status = "413 Content Too Large";
+      return -1;
+    }
+    conn->body_remaining = size;
+    conn->body_state = size ? BODY_DATA : BODY_TRAILER;
+  }
+}
 
-static void read_request_line(struct HTTPRequest* req, FILE* in) {
-  char buf[LINE_BUF_SIZE];
-  if (!fgets(buf, sizeof buf, in)) {
-    log_exit("no request line");
+// Decides where the body of the request just parsed goes: into a temporary
+// file next to the target of an upload, or nowhere. It is renamed into place
+// by do_upload_response() once complete.
+static void begin_request_body(struct Connection* conn) {
+  struct HTTPRequest* req = &conn->req;
+  conn->upload_error = 0;
+  char* expect = req->header[HEADER_EXPECT];
+  if (expect && !strcasecmp(expect, "100-continue") &&
+      req->protocol_minor_version >= 1 &&
+      conn->olen + conn->bodies_len == 0) {
+    static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    send(conn->fd, CONTINUE, sizeof CONTINUE - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
   }
-  char* p = strchr(buf, ' ');
-  if (!p) log_exit("parse error on request line (1): %s", buf);
-  *p++ = '\0';
-  req->method = xmalloc(p - buf);
-  strcpy(req->method, buf);
-  upcase(req->method);
-  char* path = p;
-  p = strchr(path, ' ');
-  if (!p) log_exit("parse error on request line (2): %s", buf);
-  *p++ = '\0';
-  req->path = xmalloc(p - path);
-  strcpy(req->path, path);
-  if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1."))) {
-    log_exit("parse error on request line (3): %s", buf);
+  if (!is_upload(req)) return;
+  if (!is_upload_path(req->path)) {
+    conn->upload_error = EACCES;
+    return;
+  }
+  char* path = req->path;
+  char* slash = strrchr(path, '/');
+  conn->upload_path = arena_alloc(&conn->arena, strlen(path) + 32);
+  sprintf(conn->upload_path, "%.*s/.%s.%d-%d.upload", (int)(slash - path),
+          path, slash + 1, getpid(), conn->fd);
+  conn->upload_fd =
+      open_beneath(conn->upload_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (conn->upload_fd < 0) {
+    conn->upload_error = errno;
+    conn->upload_path = NULL;
   }
-  p += strlen("HTTP/1.");
-  req->protocol_minor_version = atoi(p);
 }
 
-static void upcase(char* str) {
-  char* c = str;
-  while (*c) {
-    if ('a' <= *c && *c <= 'z') {
-      *c += 'A' - 'a';
+// Writes decoded body data to the upload file, if any. After a failed write
+// the rest of the body is drained and dropped.
+static void store_request_body(struct Connection* conn, char* data,
+                               size_t len) {
+  while (conn->upload_fd >= 0 && len > 0) {
+    ssize_t n = write(conn->upload_fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      conn->upload_error = errno;
+      log_error("failed to write %s: %s", conn->upload_path, strerror(errno));
+      abort_upload(conn);
+      return;
     }
-    ++c;
+    data += n;
+    len -= n;
   }
 }
 
-static struct HTTPHeaderField* read_header_field(FILE* in) {
-  char buf[LINE_BUF_SIZE];
-  if (!fgets(buf, LINE_BUF_SIZE, in)) {
-    log_exit("failed to read request header field: %s", strerror(errno));
+// Drops an unfinished upload along with its temporary file.
+static void abort_upload(struct Connection* conn) {
+  if (conn->upload_fd >= 0) {
+    close(conn->upload_fd);
+    unlinkat(docroot_fd, docroot_relative(conn->upload_path), 0);
+    conn->upload_fd = -1;
   }
-  if (buf[0] == '\n' || !strcmp(buf, "\r\n")) return NULL;
-  char* p = strchr(buf, ':');
-  if (!p) log_exit("parse error on request header field: %s", buf);
-  *p++ = '\0';
-  struct HTTPHeaderField* h = xmalloc(sizeof(struct HTTPHeaderField));
-  h->name = xmalloc(p - buf);
-  strcpy(h->name, buf);
+  conn->upload_path = NULL;
+}
 
-  p += strspn(p, " \t");
-  h->value = xmalloc(strlen(p) + 1);
-  strcpy(h->value, p);
-  return h;
+// PUT and POST store their body at the request path when --upload is given.
+static int is_upload(struct HTTPRequest* req) {
+  return upload_enabled &&
+         (!strcmp(req->method, "PUT") || !strcmp(req->method, "POST"));
 }
 
-static long content_length(struct HTTPRequest* req) {
-  char* val = lookup_header_field_value(req, "Content-Length");
-  if (!val) return 0;
-  long len = atol(val);
-  if (len < 0) log_exit("negative Content-length value");
-  return len;
+// Upload targets must name a file. Being normalized, they cannot climb out
+// of the docroot.
+static int is_upload_path(char* path) {
+  return path[strlen(path) - 1] != '/';
 }
 
-static char* lookup_header_field_value(struct HTTPRequest* req, char* name) {
-  for (struct HTTPHeaderField* h = req->header; h; h = h->next) {
-    if (!strcasecmp(h->name, name)) return h->value;
+// Returns the position just after the empty line terminating the header, or
+// NULL if it has not arrived yet.
+static char* find_header_end(char* buf, size_t len) {
+  char* end = buf + len;
+  for (char* p = buf; (p = memchr(p, '\n', end - p)); ++p) {
+    char* q = p + 1;
+    if (q < end && *q == '\r') ++q;
+    if (q < end && *q == '\n') return q + 1;
   }
   return NULL;
 }
 
-static struct FileInfo* get_fileinfo(char* docroot, char* urlpath) {
-  struct FileInfo* info = xmalloc(sizeof(struct FileInfo));
-  info->path = build_fspath(docroot, urlpath);
-  info->ok = 0;
-  struct stat st;
-  if (lstat(info->path, &st) < 0) return info;
-  if (!S_ISREG(st.st_mode)) return info;
-  info->ok = 1;
-  info->size = st.st_size;
-  return info;
+// eol points at the CR or LF ending a line. Terminates the line there and
+// returns the start of the next one, or NULL if the CR is not followed by LF.
+static char* terminate_line(char* eol) {
+  char* lf = *eol == '\r' ? eol + 1 : eol;
+  if (*lf != '\n') return NULL;
+  *eol = '\0';
+  return lf + 1;
 }
 
-static void free_fileinfo(struct FileInfo* f) {
-  free(f->path);
-  free(f);
+// Returns the first byte in [p, end) equal to one of a, b, c or d, or end.
+// Callers that need fewer than four delimiters repeat one of them.
+static char* (*scan_delimiters)(char* p, char* end, char a, char b, char c,
+                                char d) = scan_scalar;
+
+static char* scan_scalar(char* p, char* end, char a, char b, char c, char d) {
+  for (; p < end; ++p) {
+    if (*p == a || *p == b || *p == c || *p == d) break;
+  }
+  return p;
 }
 
-static char* build_fspath(char* docroot, char* urlpath) {
-  char* path = xmalloc(strlen(docroot) + strlen(urlpath) + 2);
-  sprintf(path, "%s/%s", docroot, urlpath);
-  return path;
+#if defined(__x86_64__)
+static char* scan_sse2(char* p, char* end, char a, char b, char c, char d) {
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  __m128i vc = _mm_set1_epi8(c);
+  __m128i vd = _mm_set1_epi8(d);
+  for (; end - p >= 16; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)p);
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)),
+        _mm_or_si128(_mm_cmpeq_epi8(x, vc), _mm_cmpeq_epi8(x, vd)));
+    int mask = _mm_movemask_epi8(m);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return scan_scalar(p, end, a, b, c, d);
 }
 
-static void respond_to(struct HTTPRequest* req, FILE* out, char* docroot) {
-  if (!strcmp(req->method, "GET")) {
-    do_file_response(req, out, docroot);
-  } else if (!strcmp(req->method, "HEAD")) {
-    do_file_response(req, out, docroot);
-  } else if (!strcmp(req->method, "POST")) {
-    method_not_allowed(req, out);
-  } else {
-    not_implemented(req, out);
+__attribute__((target("avx2"))) static char* scan_avx2(char* p, char* end,
+                                                       char a, char b, char c,
+                                                       char d) {
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  __m256i vc = _mm256_set1_epi8(c);
+  __m256i vd = _mm256_set1_epi8(d);
+  for (; end - p >= 32; p += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)p);
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(x, vb)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, vc), _mm256_cmpeq_epi8(x, vd)));
+    unsigned int mask = _mm256_movemask_epi8(m);
+    if (mask) return p + __builtin_ctz(mask);
   }
+  return scan_sse2(p, end, a, b, c, d);
 }
+#endif
 
-static const size_t BLOCK_BUF_SIZE = 4096;
+// Picks the widest delimiter scanner the CPU supports.
+static void init_scanner(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_delimiters = scan_avx2;
+  } else {
+    scan_delimiters = scan_sse2;
+  }
+#endif
+}
 
-static void do_file_response(struct HTTPRequest* req, FILE* out,
-                             char* docroot) {
-  struct FileInfo* info = get_fileinfo(docroot, req->path);
-  if (!info->ok) {
-    free_fileinfo(info);
-    not_found(req, out);
-    return;
+// Parses the request line at *p and advances *p to the first header field.
+static int read_request_line(struct HTTPRequest* req, char** p, char* end) {
+  char* method = *p;
+  char* q = scan_delimiters(method, end, ' ', '\r', '\n', '\n');
+  if (*q != ' ') {
+    *q = '\0';
+    log_error("parse error on request line (1): %s", method);
+    return -1;
   }
-  output_common_header_fields(req, out, "200 OK");
-  fprintf(out, "Content-Length: %ld\r\n", info->size);
-  fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-  fprintf(out, "\r\n");
-  if (strcmp(req->method, "HEAD")) {
-    int fd = open(info->path, O_RDONLY);
-    if (fd < 0) log_exit("failed to open %s: %s", info->path, strerror(errno));
-    while (1) {
-      char buf[BLOCK_BUF_SIZE];
-      ssize_t n = read(fd, buf, BLOCK_BUF_SIZE);
-      if (n < 0) log_exit("failed to read %s: %s", info->path, strerror(errno));
-      if (n == 0) break;
-      if (fwrite(buf, n, 1, out) < 1) {
-        log_exit("failed to write to socket: %s", strerror(errno));
-      }
-    }
-    close(fd);
+  *q++ = '\0';
+  req->method = method;
+  upcase(req->method);
+  char* path = q;
+  q = scan_delimiters(path, end, ' ', '\r', '\n', '\n');
+  if (*q != ' ') {
+    *q = '\0';
+    log_error("parse error on request line (2): %s", path);
+    return -1;
+  }
+  *q++ = '\0';
+  req->path = path;
+  char* version = q;
+  q = scan_delimiters(version, end, '\r', '\n', '\n', '\n');
+  char* next = terminate_line(q);
+  if (!next || strncasecmp(version, "HTTP/1.", strlen("HTTP/1."))) {
+    *q = '\0';
+    log_error("parse error on request line (3): %s", version);
+    return -1;
   }
-  fflush(out);
-  free_fileinfo(info);
+  req->protocol_minor_version = atoi(version + strlen("HTTP/1."));
+  *p = next;
+  return 0;
 }
 
-static void method_not_allowed(struct HTTPRequest* req, FILE* out) {
-  output_common_header_fields(req, out, "405 Method Not Allowed");
+static void upcase(char* str) {
+  char* c = str;
+  while (*c) {
+    if ('a' <= *c && *c <= 'z') {
+      *c += 'A' - 'a';
+    }
+    ++c;
+  }
 }
 
-static void not_implemented(struct HTTPRequest* req, FILE* out) {
-  output_common_header_fields(req, out, "400 Bad Request");
+static const struct {
+  const char* name;
+  size_t len;
+} HEADER_FIELD_NAMES[NUM_HEADER_FIELDS] = {
+    [HEADER_CONTENT_LENGTH] = {"Content-Length", 14},
+    [HEADER_HOST] = {"Host", 4},
+    [HEADER_RANGE] = {"Range", 5},
+    [HEADER_IF_NONE_MATCH] = {"If-None-Match", 13},
+    [HEADER_CONNECTION] = {"Connection", 10},
+    [HEADER_ACCEPT_ENCODING] = {"Accept-Encoding", 15},
+    [HEADER_IF_RANGE] = {"If-Range", 8},
+    [HEADER_IF_MODIFIED_SINCE] = {"If-Modified-Since", 17},
+    [HEADER_TRANSFER_ENCODING] = {"Transfer-Encoding", 17},
+    [HEADER_EXPECT] = {"Expect", 6},
+    [HEADER_REFERER] = {"Referer", 7},
+    [HEADER_USER_AGENT] = {"User-Agent", 10},
+};
+
+// Parses the header field at *p and advances *p to the next line. The value
+// of a known field is stored in its slot in req->header.
+static int read_header_field(struct HTTPRequest* req, char** p, char* end) {
+  char* name = *p;
+  char* q = scan_delimiters(name, end, ':', ' ', '\r', '\n');
+  if (*q != ':') {
+    *q = '\0';
+    log_error("parse error on request header field: %s", name);
+    return -1;
+  }
+  int field = lookup_header_field(name, q - name);
+  char* value = q + 1;
+  while (*value == ' ' || *value == '\t') ++value;
+  q = scan_delimiters(value, end, '\r', '\n', '\n', '\n');
+  char* next = terminate_line(q);
+  if (!next) {
+    log_error("parse error on request header field: stray CR");
+    return -1;
+  }
+  while (q > value && (q[-1] == ' ' || q[-1] == '\t')) *--q = '\0';
+  if (field < 0) {
+    *p = next;
+    return 0;
+  }
+  // Repeats that another server could read as a different body length are
+  // refused, so that no request can be smuggled past it.
+  char* prev = req->header[field];
+  if (prev && (field == HEADER_TRANSFER_ENCODING ||
+               (field == HEADER_CONTENT_LENGTH && strcmp(prev, value)))) {
+    log_error("conflicting %s fields", HEADER_FIELD_NAMES[field].name);
+    return -1;
+  }
+  req->header[field] = value;
+  *p = next;
+  return 0;
 }
 
-static void not_found(struct HTTPRequest* req, FILE* out) {
-  output_common_header_fields(req, out, "404 Not Found");
+// Returns the HeaderField for the given name, or -1 if it is not one the
+// server cares about.
+static int lookup_header_field(char* name, size_t len) {
+  for (int i = 0; i < NUM_HEADER_FIELDS; ++i) {
+    if (HEADER_FIELD_NAMES[i].len == len &&
+        !strncasecmp(HEADER_FIELD_NAMES[i].name, name, len)) {
+      return i;
+    }
+  }
+  return -1;
 }
 
-static const size_t TIME_BUF_SIZE = 1024;
-static const int HTTP_MINOR_VERSION = 0;
-static const char* SERVER_VERSION = "1.0";
+// Returns the Content-Length value, 0 if there is none or -1 if it is not a
+// decimal number that fits in a long.
+static long content_length(struct HTTPRequest* req) {
+  char* val = req->header[HEADER_CONTENT_LENGTH];
+  if (!val) return 0;
+  if (!is_digit(*val)) return -1;
+  char* end;
+  errno = 0;
+  long len = strtol(val, &end, 10);
+  if (*end || errno == ERANGE) return -1;
+  return len;
+}
 
-static void output_common_header_fields(struct HTTPRequest* req, FILE* out,
-                                        char* status) {
-  time_t t = time(NULL);
-  struct tm* tm = gmtime(&t);
-  if (!tm) log_exit("gmtime() failed: %s", strerror(errno));
-  char buf[TIME_BUF_SIZE];
-  strftime(buf, sizeof buf, "%a, %d %b %Y %H:%M:%S GMT", tm);
-  fprintf(out, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
-  fprintf(out, "Date: %s\r\n", buf);
-  fprintf(out, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
-  fprintf(out, "Connection: close\r\n");
+// HTTP/1.1 connections persist unless the client opts out; HTTP/1.0 ones
+// only if the client asks for it.
+static int wants_keep_alive(struct HTTPRequest* req) {
+  char* val = req->header[HEADER_CONNECTION];
+  if (req->protocol_minor_version >= 1) {
+    return !val || !strcasestr(val, "close");
+  }
+  return val && strcasestr(val, "keep-alive");
 }
 
-static char* guess_content_type(struct FileInfo* f) {
-  return "text/plain";
-}
-
-static const int MAX_BACKLOG = 5;
-
-static int listen_socket(char* path) {
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-  struct addrinfo* res;
-  int err = getaddrinfo(NULL, port, &hints, &res);
-  if (err) log_exit(gai_strerror(err));
-  for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
-    int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (sock < 0) continue;
-    if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
-      close(sock);
-      continue;
-    }
-    if (listen(sock, MAX_BACKLOG) < 0) {
-      close(sock);
-      continue;
+// Returns whether Accept-Encoding lists gzip, or failing that "*", with a
+// nonzero quality value.
+static int accepts_gzip(struct HTTPRequest* req) {
+  char* p = req->header[HEADER_ACCEPT_ENCODING];
+  if (!p) return 0;
+  int any = 0;
+  while (*p) {
+    p += strspn(p, " \t,");
+    char* name = p;
+    size_t len = strcspn(p, " \t;,");
+    p += len;
+    double q = 1;
+    p += strspn(p, " \t");
+    while (*p == ';') {
+      p += 1 + strspn(p + 1, " \t");
+      if ((*p == 'q' || *p == 'Q') && p[1] == '=') q = strtod(p + 2, NULL);
+      p += strcspn(p, ";,");
     }
-    freeaddrinfo(res);
-    return sock;
+    if (len == 4 && !strncasecmp(name, "gzip", 4)) return q > 0;
+    if (len == 1 && *name == '*') any = q > 0;
+    p += strcspn(p, ",");
   }
-  log_exit("failed to listen socket");
-  return -1;
+  return any;
 }
 
-static void server_main(int server_fd, char* doc_root) {
-  for (;;) {
-    struct sockaddr_storage addr;
-    socklen_t addrlen = sizeof addr;
-    int sock = accept(server_fd, (struct sockaddr*)&addr, &addrlen);
-    if (sock < 0) log_exit("accept(2) failed: %s", strerror(errno));
-    int pid = fork();
-    if (pid < 0) exit(3);
-    if (pid == 0) {
-      FILE* in = fdopen(sock, "r");
-      FILE* out = fdopen(sock, "w");
-      service(in, out, docroot);
-      exit(0);
+static int is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Parses a Range field into the ranges that overlap a file of size bytes.
+// Returns their number, which is 0 if none does, or -1 if the field is to be
+// ignored because it is malformed, not in bytes or lists more than max
+// ranges.
+static int parse_ranges(char* val, long size, struct ByteRange* ranges,
+                        int max) {
+  if (strncasecmp(val, "bytes=", 6)) return -1;
+  char* p = val + 6;
+  int n = 0;
+  for (int total = 1;; ++total) {
+    if (total > max) return -1;
+    p += strspn(p, " \t");
+    struct ByteRange r;
+    if (*p == '-') {
+      if (!is_digit(p[1])) return -1;
+      long suffix = strtol(p + 1, &p, 10);
+      r.first = suffix < size ? size - suffix : 0;
+      r.last = size - 1;
+      if (suffix > 0 && size > 0) ranges[n++] = r;
+    } else {
+      if (!is_digit(*p)) return -1;
+      r.first = strtol(p, &p, 10);
+      if (*p++ != '-') return -1;
+      r.last = size - 1;
+      if (is_digit(*p)) {
+        long last = strtol(p, &p, 10);
+        if (last < r.first) return -1;
+        if (last < r.last) r.last = last;
+      }
+      if (r.first < size) ranges[n++] = r;
     }
-    close(sock);
+    p += strspn(p, " \t");
+    if (!*p) return n;
+    if (*p++ != ',') return -1;
   }
 }
 
+// Returns whether the Range field applies given the If-Range field, which
+// must then carry f's entity tag, compared strongly, or modification time.
+static int if_range_matches(struct HTTPRequest* req, struct CachedFile* f) {
+  char* val = req->header[HEADER_IF_RANGE];
+  if (!val) return 1;
+  if (*val == '"') return !strcmp(val, f->etag);
+  return parse_http_date(val) == f->mtime;
+}
+
+// Parses an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT". Returns -1
+// on failure.
+static time_t parse_http_date(char* val) {
+  struct tm tm;
+  memset(&tm, 0, sizeof tm);
+  char* end = strptime(val, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end) return -1;
+  return timegm(&tm);
+}
+
+static void format_http_date(char* buf, size_t size, time_t t) {
+  struct tm tm;
+  if (!gmtime_r(&t, &tm)) {
+    log_exit("gmtime() failed: %s", strerror(errno));
+  }
+  strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// Entity tags change whenever the file is replaced, resized or modified.
+static void format_etag(char* buf, size_t size, ino_t ino, long len,
+                        time_t mtime) {
+  snprintf(buf, size, "\"%lx-%lx-%lx\"", (unsigned long)ino,
+           (unsigned long)len, (unsigned long)mtime);
+}
+
+// The gzip variant of a file is a different representation, so its entity
+// tag differs from the file's.
+static void format_gzip_etag(char* buf, size_t size, const char* etag) {
+  snprintf(buf, size, "%.*s-gz\"", (int)strlen(etag) - 1, etag);
+}
+
+// Returns whether an If-None-Match field is "*" or lists etag, comparing
+// weakly.
+static int etag_matches(char* val, const char* etag) {
+  size_t len = strlen(etag);
+  for (char* p = val;;) {
+    p += strspn(p, " \t,");
+    if (*p == '*') return 1;
+    if (!strncmp(p, "W/", 2)) p += 2;
+    if (*p != '"') return 0;
+    char* end = strchr(p + 1, '"');
+    if (!end) return 0;
+    if (end + 1 - p == (long)len && !strncmp(p, etag, len)) return 1;
+    p = end + 1;
+  }
+}
+
+// Opens the file behind urlpath. Symbolic links are not followed and only
+// regular files are ok.
+static void get_fileinfo(struct FileInfo* info, char* urlpath) {
+  info->path = urlpath;
+  info->ok = 0;
+  info->fd = -1;
+  // The type is checked through an O_PATH descriptor first, as opening a FIFO
+  // or a device for reading could block or have side effects.
+  int fd = open_beneath(urlpath, O_PATH | O_NOFOLLOW, 0);
+  if (fd < 0) return;
+  struct stat st;
+  int err = check_file_type(fd, &st);
+  close(fd);
+  if (err) {
+    errno = err;
+    return;
+  }
+  // O_NONBLOCK keeps a FIFO swapped in meanwhile from blocking the open.
+  fd = open_beneath(urlpath, O_RDONLY | O_NOFOLLOW | O_NONBLOCK, 0);
+  if (fd < 0) return;
+  err = check_file_type(fd, &st);
+  if (!err && fcntl(fd, F_SETFL, 0) < 0) err = errno;
+  if (err) {
+    close(fd);
+    errno = err;
+    return;
+  }
+  info->fd = fd;
+  info->ok = 1;
+  info->size = st.st_size;
+  info->mtime = st.st_mtime;
+  info->ino = st.st_ino;
+}
+
+// Returns 0 if fd is a regular file, filling in st, or the errno to fail
+// with as file_type_error().
+static int check_file_type(int fd, struct stat* st) {
+  if (fstat(fd, st) < 0) return errno;
+  return file_type_error(st->st_mode);
+}
+
+// Returns 0 for a regular file, or the errno to fail with: EISDIR for a
+// directory, ELOOP for a symbolic link and EACCES for anything else that is
+// not to be read.
+static int file_type_error(mode_t mode) {
+  if (S_ISREG(mode)) return 0;
+  if (S_ISDIR(mode)) return EISDIR;
+  return S_ISLNK(mode) ? ELOOP : EACCES;
+}
+
+// Opens the docroot, which every file is then looked up beneath, and makes
+// its path absolute for the inotify watches, which are added by path. Done
+// before daemonizing changes the working directory to /, so a relative
+// docroot works too.
+static void open_docroot(void) {
+  if (*docroot) {
+    char* path = realpath(docroot, NULL);
+    if (!path) log_exit("failed to resolve %s: %s", docroot, strerror(errno));
+    docroot = path;
+  }
+  docroot_fd = open(*docroot ? docroot : "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (docroot_fd < 0) {
+    log_exit("failed to open %s: %s", docroot, strerror(errno));
+  }
+}
+
+// Maps a normalized urlpath to a path relative to docroot_fd.
+static const char* docroot_relative(const char* urlpath) {
+  return urlpath[1] ? urlpath + 1 : ".";
+}
+
+// Opens urlpath, which must be normalized, beneath the docroot. openat2(2)
+// resolves it without leaving the docroot through symbolic links or
+// /proc-style magic links, failing with EXDEV or ELOOP instead. Kernels before
+// 5.6 lack it and get openat(2), where normalization only keeps ".." out.
+static int open_beneath(const char* urlpath, int flags, mode_t mode) {
+  static _Atomic int no_openat2 = 0;
+  const char* path = docroot_relative(urlpath);
+  if (!no_openat2) {
+    struct open_how how = {
+        .flags = flags | O_CLOEXEC,
+        .mode = flags & O_CREAT ? mode : 0,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = syscall(SYS_openat2, docroot_fd, path, &how, sizeof how);
+    if (fd >= 0 || errno != ENOSYS) return fd;
+    no_openat2 = 1;
+  }
+  return openat(docroot_fd, path, flags | O_CLOEXEC, mode);
+}
+
+// Percent-encodes a decoded path for use in a header, keeping its slashes.
+static char* escape_path(struct Arena* arena, const char* path) {
+  char* escaped = arena_alloc(arena, strlen(path) * 3 + 1);
+  char* q = escaped;
+  for (const unsigned char* p = (const unsigned char*)path; *p; ++p) {
+    if (isalnum(*p) || strchr("-._~/", *p)) {
+      *q++ = *p;
+    } else {
+      q += sprintf(q, "%%%02X", *p);
+    }
+  }
+  *q = '\0';
+  return escaped;
+}
+
+static const int MAX_CACHED_FDS = 256;
+static const unsigned int FILE_CACHE_BUCKETS = 1024;
+
+static int inotify_fd = -1;
+static struct CachedFile** file_cache = NULL;
+static int cached_fds = 0;
+static long cached_memory = 0;
+static struct CachedFile* lru_head = NULL;
+static struct CachedFile* lru_tail = NULL;
+static struct WatchedDir* watched_dirs = NULL;
+
+static void init_file_cache(void) {
+  file_cache = xmalloc(sizeof(struct CachedFile*) * FILE_CACHE_BUCKETS);
+  memset(file_cache, 0, sizeof(struct CachedFile*) * FILE_CACHE_BUCKETS);
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    log_error("inotify_init1(2) failed, file cache disabled: %s",
+              strerror(errno));
+  }
+}
+
+static unsigned int hash_string(char* s) {
+  unsigned int h = 2166136261u;
+  for (; *s; ++s) h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+}
+
+// Returns a reference to the file behind urlpath, or NULL with errno set if
+// there is no regular file there; EISDIR means a directory. The caller drops
+// it with release_cached_file().
+static struct CachedFile* open_cached_file(struct Arena* arena, char* docroot,
+                                           char* urlpath) {
+  struct CachedFile* f = lookup_cached_file(urlpath, 0);
+  if (f) return f;
+  stat_add(&stats->cache_misses, 1);
+  // Watch the directory before opening so that no change can slip by.
+  struct WatchedDir* dir = watch_directory(arena, docroot, urlpath);
+  f = load_file(urlpath);
+  if (!f) {
+    int err = errno;
+    if (dir && !dir->files) prune_watched_dirs();
+    errno = err;
+    return NULL;
+  }
+  insert_cached_file(f, dir);
+  return f;
+}
+
+// Opens urlpath into a new entry, not in the cache yet, reading small files
+// into memory. Returns NULL with errno set on failure. Touches nothing
+// shared, so the I/O threads run it too.
+static struct CachedFile* load_file(char* urlpath) {
+  struct FileInfo info;
+  get_fileinfo(&info, urlpath);
+  if (!info.ok) return NULL;
+  struct CachedFile* f = new_file_entry(&info);
+  fill_cached_file(f, &info);
+  return f;
+}
+
+// Allocates the entry for the file opened in info, with room for its body if
+// it is small enough to be kept in memory.
+static struct CachedFile* new_file_entry(struct FileInfo* info) {
+  char etag[64];
+  format_etag(etag, sizeof etag, info->ino, info->size, info->mtime);
+  return new_cached_file(info->path, 0, info->size, info->mtime, etag,
+                         guess_content_type(info),
+                         info->size <= cache_max_file_size);
+}
+
+static const long GZIP_MIN_SIZE = 256;
+static const long GZIP_MAX_SIZE = 1 << 20;
+
+// Returns a reference to the gzip encoded variant of base, which is the file
+// behind urlpath. A precompressed urlpath.gz is preferred; otherwise
+// compressible types are compressed here and kept in the cache like any
+// other entry. Returns NULL if base is better sent as is.
+static struct CachedFile* open_gzip_file(struct Arena* arena, char* docroot,
+                                         char* urlpath,
+                                         struct CachedFile* base) {
+  if (base->no_gzip) return NULL;
+  struct CachedFile* f = lookup_cached_file(urlpath, 1);
+  if (f && f->base_mtime == base->mtime) return f;
+  if (f) {
+    if (f->cached) evict_cached_file(f);
+    release_cached_file(f);
+  }
+  stat_add(&stats->cache_misses, 1);
+  char etag[64];
+  format_gzip_etag(etag, sizeof etag, base->etag);
+  struct WatchedDir* dir = watch_directory(arena, docroot, urlpath);
+  // Listing pages, whose urlpath ends with a slash, have no sibling.
+  char* path = arena_alloc(arena, strlen(urlpath) + 4);
+  sprintf(path, "%s.gz", urlpath);
+  struct FileInfo info = {.ok = 0};
+  if (urlpath[strlen(urlpath) - 1] != '/') get_fileinfo(&info, path);
+  if (info.ok) {
+    char sibling_etag[64];
+    format_etag(sibling_etag, sizeof sibling_etag, info.ino, info.size,
+                info.mtime);
+    format_gzip_etag(etag, sizeof etag, sibling_etag);
+    f = new_cached_file(urlpath, 1, info.size, info.mtime, etag,
+                        base->content_type,
+                        info.size <= cache_max_file_size);
+    f->base_mtime = base->mtime;
+    fill_cached_file(f, &info);
+    insert_cached_file(f, dir);
+    return f;
+  }
+
+  // Compressing is only worth it when the result can be cached.
+  if (!dir || !is_compressible(base->content_type) ||
+      base->size < GZIP_MIN_SIZE || base->size > GZIP_MAX_SIZE) {
+    if (dir && !dir->files) prune_watched_dirs();
+    base->no_gzip = 1;
+    return NULL;
+  }
+  unsigned char* data = (unsigned char*)base->body;
+  if (!data) {
+    data = xmalloc(base->size);
+    if (pread(base->fd, data, base->size, 0) != base->size) {
+      free(data);
+      base->no_gzip = 1;
+      return NULL;
+    }
+  }
+  unsigned char* out = xmalloc(base->size + base->size / 8 + 32);
+  long len = gzip_compress(data, base->size, out, base->mtime);
+  if (data != (unsigned char*)base->body) free(data);
+  if (len >= base->size) {
+    free(out);
+    base->no_gzip = 1;
+    return NULL;
+  }
+  f = new_cached_file(urlpath, 1, len, base->mtime, etag, base->content_type,
+                      1);
+  memcpy(f->body, out, len);
+  free(out);
+  insert_cached_file(f, dir);
+  return f;
+}
+
+// Returns a new reference to the cached entry for urlpath, or NULL.
+static struct CachedFile* lookup_cached_file(char* urlpath, int gzip) {
+  struct CachedFile* f = find_cached_file(urlpath, gzip);
+  if (f) {
+    if (f != lru_head) {
+      f->lru_prev->lru_next = f->lru_next;
+      if (f->lru_next) {
+        f->lru_next->lru_prev = f->lru_prev;
+      } else {
+        lru_tail = f->lru_prev;
+      }
+      f->lru_prev = NULL;
+      f->lru_next = lru_head;
+      lru_head->lru_prev = f;
+      lru_head = f;
+    }
+    if (f->body) {
+      stat_add(&stats->cache_memory_hits, 1);
+    } else {
+      stat_add(&stats->cache_fd_hits, 1);
+    }
+    ++f->refs;
+  }
+  return f;
+}
+
+static struct CachedFile* find_cached_file(char* urlpath, int gzip) {
+  unsigned int hash = hash_string(urlpath) ^ gzip;
+  struct CachedFile* f = file_cache[hash & (FILE_CACHE_BUCKETS - 1)];
+  while (f && (f->hash != hash || f->gzip != gzip ||
+               strcmp(f->urlpath, urlpath))) {
+    f = f->hash_next;
+  }
+  return f;
+}
+
+// Allocates an uncached entry with its header block. If in_memory and the
+// size fits the memory limit, room for the body is reserved right behind
+// the header block and its terminating blank line, so that a whole 200
+// response after the common fields is one contiguous buffer.
+static struct CachedFile* new_cached_file(char* urlpath, int gzip, long size,
+                                          time_t mtime, const char* etag,
+                                          char* content_type, int in_memory) {
+  static const char* format =
+      "Content-Length: %ld\r\nContent-Type: %s\r\nLast-Modified: %s\r\n"
+      "ETag: %s\r\n%sVary: Accept-Encoding\r\n\r\n";
+  // Ranges are only served from the identity encoding.
+  const char* encoding =
+      gzip ? "Content-Encoding: gzip\r\n" : "Accept-Ranges: bytes\r\n";
+  struct CachedFile* f = xmalloc(sizeof(struct CachedFile));
+  f->urlpath = strdup(urlpath);
+  f->hash = hash_string(urlpath) ^ gzip;
+  f->gzip = gzip;
+  f->no_gzip = 0;
+  char* slash = strrchr(urlpath, '/');
+  f->name = strdup(slash ? slash + 1 : urlpath);
+  if (!f->urlpath || !f->name) log_exit("failed to allocate memory");
+  f->fd = -1;
+  f->size = size;
+  f->mtime = f->base_mtime = mtime;
+  snprintf(f->etag, sizeof f->etag, "%s", etag);
+  format_http_date(f->last_modified, sizeof f->last_modified, mtime);
+  f->content_type = content_type;
+  int len = snprintf(NULL, 0, format, size, content_type, f->last_modified,
+                     f->etag, encoding);
+  in_memory = in_memory && size <= cache_memory_limit;
+  f->header = xmalloc(len + 1 + (in_memory ? size : 0));
+  snprintf(f->header, len + 1, format, size, content_type, f->last_modified,
+           f->etag, encoding);
+  f->header_len = len - 2;
+  f->body = in_memory ? f->header + len : NULL;
+  f->refs = 1;
+  f->cached = 0;
+  f->dir = NULL;
+  return f;
+}
+
+// Reads the body of the file opened in info into f, or failing that hands
+// over its fd.
+static void fill_cached_file(struct CachedFile* f, struct FileInfo* info) {
+  if (f->body && pread(info->fd, f->body, f->size, 0) == f->size) {
+    close(info->fd);
+  } else {
+    f->body = NULL;
+    f->fd = info->fd;
+  }
+  info->fd = -1;
+}
+
+// Adds f to the cache, which takes a reference of its own, if its directory
+// is being watched.
+static void insert_cached_file(struct CachedFile* f, struct WatchedDir* dir) {
+  if (!dir) return;
+  struct CachedFile** bucket = &file_cache[f->hash & (FILE_CACHE_BUCKETS - 1)];
+  f->cached = 1;
+  f->dir = dir;
+  ++f->refs;
+  if (f->fd >= 0) ++cached_fds;
+  if (f->body) cached_memory += f->size;
+  f->hash_next = *bucket;
+  *bucket = f;
+  f->lru_prev = NULL;
+  f->lru_next = lru_head;
+  if (lru_head) {
+    lru_head->lru_prev = f;
+  } else {
+    lru_tail = f;
+  }
+  lru_head = f;
+  f->dir_prev = NULL;
+  f->dir_next = dir->files;
+  if (dir->files) dir->files->dir_prev = f;
+  dir->files = f;
+  shrink_file_cache();
+}
+
+static void release_cached_file(struct CachedFile* f) {
+  if (--f->refs > 0) return;
+  if (f->fd >= 0) close(f->fd);
+  free(f->urlpath);
+  free(f->name);
+  free(f->header);
+  free(f);
+}
+
+// Drops f from the cache; it is freed once the last response using it is
+// done. A directory left without cached files stops being watched.
+static void evict_cached_file(struct CachedFile* f) {
+  struct WatchedDir* dir = f->dir;
+  struct CachedFile** p = &file_cache[f->hash & (FILE_CACHE_BUCKETS - 1)];
+  while (*p != f) p = &(*p)->hash_next;
+  *p = f->hash_next;
+  if (f->lru_prev) {
+    f->lru_prev->lru_next = f->lru_next;
+  } else {
+    lru_head = f->lru_next;
+  }
+  if (f->lru_next) {
+    f->lru_next->lru_prev = f->lru_prev;
+  } else {
+    lru_tail = f->lru_prev;
+  }
+  if (f->dir_prev) {
+    f->dir_prev->dir_next = f->dir_next;
+  } else {
+    dir->files = f->dir_next;
+  }
+  if (f->dir_next) f->dir_next->dir_prev = f->dir_prev;
+  if (f->fd >= 0) --cached_fds;
+  if (f->body) cached_memory -= f->size;
+  f->cached = 0;
+  release_cached_file(f);
+  if (!dir->files) prune_watched_dirs();
+}
+
+// Stops watching the directories that have neither cached files nor loads
+// in progress.
+static void prune_watched_dirs(void) {
+  for (struct WatchedDir** p = &watched_dirs; *p;) {
+    struct WatchedDir* dir = *p;
+    if (dir->files || dir->loads) {
+      p = &dir->next;
+      continue;
+    }
+    inotify_rm_watch(inotify_fd, dir->wd);
+    *p = dir->next;
+    free(dir);
+  }
+}
+
+// Evicts least recently used entries until the open descriptors and the
+// bodies held in memory are within their limits. Only entries that hold the
+// exceeded resource are evicted.
+static void shrink_file_cache(void) {
+  for (struct CachedFile* f = lru_tail; f;) {
+    struct CachedFile* prev = f->lru_prev;
+    int over_fds = cached_fds > MAX_CACHED_FDS;
+    int over_memory = cached_memory > cache_memory_limit;
+    if (!over_fds && !over_memory) return;
+    if ((over_fds && f->fd >= 0) || (over_memory && f->body)) {
+      evict_cached_file(f);
+    }
+    f = prev;
+  }
+}
+
+static void log_cache_stats(void) {
+  log_info("file cache: %lu memory hits, %lu fd hits, %lu misses, "
+           "%d fds, %ld bytes in memory",
+           stat_load(&stats->cache_memory_hits),
+           stat_load(&stats->cache_fd_hits), stat_load(&stats->cache_misses),
+           cached_fds, cached_memory);
+}
+
+// Returns whether a change to the directory entry name invalidates f: either
+// it is f's file or the precompressed sibling that gzip variants come from.
+// Listing pages, whose name is empty, change with any entry.
+static int affects_cached_file(struct CachedFile* f, const char* name) {
+  if (!f->name[0]) return 1;
+  size_t len = strlen(f->name);
+  return !strncmp(f->name, name, len) &&
+         (!name[len] || !strcmp(name + len, ".gz"));
+}
+
+static int is_compressible(const char* content_type) {
+  return !strncmp(content_type, "text/", 5) ||
+         strstr(content_type, "javascript") || strstr(content_type, "json") ||
+         strstr(content_type, "xml");
+}
+
+static const int GZIP_HASH_BITS = 15;
+static const int GZIP_MAX_CHAIN = 32;
+static const long DEFLATE_WINDOW = 32768;
+static const int DEFLATE_MAX_MATCH = 258;
+
+// Compresses src into dst as a gzip member (RFC 1952) holding a single
+// deflate block with the fixed Huffman codes, which needs no code tables and
+// still gets most of the gain on markup and scripts. dst must have room for
+// len + len / 8 + 32 bytes. Returns the compressed length.
+static long gzip_compress(const unsigned char* src, long len,
+                          unsigned char* dst, time_t mtime) {
+  unsigned char* p = dst;
+  *p++ = 0x1f;
+  *p++ = 0x8b;
+  *p++ = 8;  // deflate
+  *p++ = 0;
+  for (int i = 0; i < 4; ++i) *p++ = (uint32_t)mtime >> (8 * i);
+  *p++ = 0;
+  *p++ = 3;  // Unix
+  struct BitWriter w = {p, 0, 0};
+  put_bits(&w, 1, 1);  // BFINAL
+  put_bits(&w, 1, 2);  // BTYPE: fixed Huffman codes
+  int* head = xmalloc(sizeof(int) << GZIP_HASH_BITS);
+  memset(head, 0xff, sizeof(int) << GZIP_HASH_BITS);
+  int* prev = xmalloc(sizeof(int) * len);
+  long pos = 0;
+  while (pos < len) {
+    int best_len = 0;
+    int best_dist = 0;
+    if (pos + 3 <= len) {
+      long max = len - pos < DEFLATE_MAX_MATCH ? len - pos : DEFLATE_MAX_MATCH;
+      unsigned int h = ((src[pos] << 10) ^ (src[pos + 1] << 5) ^ src[pos + 2]) &
+                       ((1 << GZIP_HASH_BITS) - 1);
+      int chain = GZIP_MAX_CHAIN;
+      for (int i = head[h]; i >= 0 && pos - i <= DEFLATE_WINDOW && chain-- > 0;
+           i = prev[i]) {
+        int n = 0;
+        while (n < max && src[i + n] == src[pos + n]) ++n;
+        if (n > best_len) {
+          best_len = n;
+          best_dist = pos - i;
+          if (n == max) break;
+        }
+      }
+    }
+    long end = pos + 1;
+    if (best_len >= 3) {
+      put_match(&w, best_len, best_dist);
+      end = pos + best_len;
+    } else {
+      put_symbol(&w, src[pos]);
+    }
+    for (; pos < end; ++pos) {
+      if (pos + 3 > len) continue;
+      unsigned int h = ((src[pos] << 10) ^ (src[pos + 1] << 5) ^ src[pos + 2]) &
+                       ((1 << GZIP_HASH_BITS) - 1);
+      prev[pos] = head[h];
+      head[h] = pos;
+    }
+  }
+  put_symbol(&w, 256);  // end of block
+  if (w.nbits) *w.p++ = w.bits;
+  free(head);
+  free(prev);
+  p = w.p;
+  uint32_t crc = gzip_crc32(src, len);
+  for (int i = 0; i < 4; ++i) *p++ = crc >> (8 * i);
+  for (int i = 0; i < 4; ++i) *p++ = (uint32_t)len >> (8 * i);
+  return p - dst;
+}
+
+static void put_bits(struct BitWriter* w, uint32_t value, int n) {
+  w->bits |= value << w->nbits;
+  w->nbits += n;
+  while (w->nbits >= 8) {
+    *w->p++ = w->bits;
+    w->bits >>= 8;
+    w->nbits -= 8;
+  }
+}
+
+// Huffman codes are packed starting from their most significant bit.
+static void put_code(struct BitWriter* w, uint32_t code, int n) {
+  uint32_t reversed = 0;
+  for (int i = 0; i < n; ++i) reversed |= ((code >> i) & 1) << (n - 1 - i);
+  put_bits(w, reversed, n);
+}
+
+// Writes a literal/length symbol with the fixed code of RFC 1951 3.2.6.
+static void put_symbol(struct BitWriter* w, int sym) {
+  if (sym < 144) {
+    put_code(w, 0x30 + sym, 8);
+  } else if (sym < 256) {
+    put_code(w, 0x190 + sym - 144, 9);
+  } else if (sym < 280) {
+    put_code(w, sym - 256, 7);
+  } else {
+    put_code(w, 0xc0 + sym - 280, 8);
+  }
+}
+
+static const int LENGTH_BASE[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                     1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                     4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int DIST_BASE[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const int DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                   4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                   9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static void put_match(struct BitWriter* w, int len, int dist) {
+  int i = 28;
+  while (LENGTH_BASE[i] > len) --i;
+  put_symbol(w, 257 + i);
+  put_bits(w, len - LENGTH_BASE[i], LENGTH_EXTRA[i]);
+  int j = 29;
+  while (DIST_BASE[j] > dist) --j;
+  put_code(w, j, 5);
+  put_bits(w, dist - DIST_BASE[j], DIST_EXTRA[j]);
+}
+
+static uint32_t gzip_crc32(const unsigned char* p, long len) {
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  uint32_t crc = 0xffffffff;
+  for (long i = 0; i < len; ++i) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffff;
+}
+
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                   IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF |
+                                   IN_ONLYDIR;
+
+// Starts watching the directory that contains urlpath. Returns NULL if it
+// cannot be watched, in which case files there are not cached.
+static struct WatchedDir* watch_directory(struct Arena* arena, char* docroot,
+                                          char* urlpath) {
+  if (inotify_fd < 0) return NULL;
+  char* slash = strrchr(urlpath, '/');
+  int len = slash ? slash - urlpath : 0;
+  char* path = arena_alloc(arena, strlen(docroot) + len + 4);
+  sprintf(path, "%s/%.*s/.", docroot, len, urlpath);
+  int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+  if (wd < 0) return NULL;
+  for (struct WatchedDir* dir = watched_dirs; dir; dir = dir->next) {
+    if (dir->wd == wd) return dir;
+  }
+  struct WatchedDir* dir = xmalloc(sizeof(struct WatchedDir));
+  dir->wd = wd;
+  dir->files = NULL;
+  dir->changes = 0;
+  dir->loads = 0;
+  dir->next = watched_dirs;
+  watched_dirs = dir;
+  return dir;
+}
+
+static char HTML_CONTENT_TYPE[] = "text/html; charset=utf-8";
+
+// Renders the listing page of the directory at urlpath, which ends with a
+// slash, into a cache entry. The page is cached like a file in memory and
+// evicted by the inotify events that also bump the directory's mtime, which
+// its validators are derived from; so a directory of any size is only read
+// again after it changes. Returns NULL with errno set on failure.
+static struct CachedFile* open_directory_listing(struct Arena* arena,
+                                                 char* docroot,
+                                                 char* urlpath) {
+  struct WatchedDir* dir = watch_directory(arena, docroot, urlpath);
+  // O_DIRECTORY refuses anything else before it is opened, and O_NONBLOCK
+  // keeps that from ever blocking.
+  int fd = open_beneath(urlpath,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NONBLOCK, 0);
+  struct stat st;
+  char* html = NULL;
+  size_t len;
+  FILE* out = NULL;
+  if (fd < 0 || fstat(fd, &st) < 0 ||
+      !(out = open_memstream(&html, &len)) ||
+      render_directory_listing(fd, urlpath, out) < 0) {
+    int err = errno;
+    if (out) fclose(out);
+    free(html);
+    if (fd >= 0) close(fd);
+    if (dir && !dir->files) prune_watched_dirs();
+    errno = err;
+    return NULL;
+  }
+  fclose(out);
+  close(fd);
+  char etag[64];
+  format_etag(etag, sizeof etag, st.st_ino, len, st.st_mtime);
+  struct CachedFile* f = new_cached_file(urlpath, 0, len, st.st_mtime, etag,
+                                         HTML_CONTENT_TYPE, 1);
+  if (!f->body) {
+    // Larger than the whole cache: served this once and then dropped.
+    f->header = realloc(f->header, f->header_len + 2 + len);
+    if (!f->header) log_exit("failed to allocate memory");
+    f->body = f->header + f->header_len + 2;
+    memcpy(f->body, html, len);
+    free(html);
+    if (dir && !dir->files) prune_watched_dirs();
+    return f;
+  }
+  memcpy(f->body, html, len);
+  free(html);
+  insert_cached_file(f, dir);
+  return f;
+}
+
+// Writes the HTML listing of the directory open at fd, reading it with
+// getdents64(2) in large batches. Dot files are left out, and so are entries
+// that would not be served, such as symbolic links. Returns -1 with errno set
+// on failure.
+static int render_directory_listing(int fd, char* urlpath, FILE* out) {
+  static const size_t DIRENT_BUF_SIZE = 65536;
+  char* buf = xmalloc(DIRENT_BUF_SIZE);
+  struct ListingEntry* entries = NULL;
+  size_t nentries = 0;
+  size_t capacity = 0;
+  int ret = 0;
+  for (;;) {
+    long n = syscall(SYS_getdents64, fd, buf, DIRENT_BUF_SIZE);
+    if (n <= 0) {
+      if (n < 0) ret = -1;
+      break;
+    }
+    for (long pos = 0; pos < n;) {
+      struct LinuxDirent64* d = (struct LinuxDirent64*)(buf + pos);
+      pos += d->d_reclen;
+      if (d->d_name[0] == '.') continue;
+      struct stat st;
+      if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+      if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) continue;
+      if (nentries == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        entries = realloc(entries, sizeof(struct ListingEntry) * capacity);
+        if (!entries) log_exit("failed to allocate memory");
+      }
+      struct ListingEntry* e = &entries[nentries++];
+      e->name = strdup(d->d_name);
+      if (!e->name) log_exit("failed to allocate memory");
+      e->is_dir = S_ISDIR(st.st_mode);
+      e->size = st.st_size;
+      e->mtime = st.st_mtime;
+    }
+  }
+  free(buf);
+  if (ret == 0) {
+    qsort(entries, nentries, sizeof(struct ListingEntry),
+          compare_listing_entries);
+    fprintf(out, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+                 "<title>Index of ");
+    output_html_escaped(out, urlpath);
+    fprintf(out, "</title>\n</head>\n<body>\n<h1>Index of ");
+    output_html_escaped(out, urlpath);
+    fprintf(out, "</h1>\n<table>\n"
+                 "<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>\n");
+    if (strcmp(urlpath, "/")) {
+      fprintf(out, "<tr><td><a href=\"../\">../</a></td><td></td><td></td>"
+                   "</tr>\n");
+    }
+    for (size_t i = 0; i < nentries; ++i) {
+      struct ListingEntry* e = &entries[i];
+      const char* slash = e->is_dir ? "/" : "";
+      char date[32];
+      struct tm tm;
+      strftime(date, sizeof date, "%Y-%m-%d %H:%M",
+               gmtime_r(&e->mtime, &tm));
+      fprintf(out, "<tr><td><a href=\"");
+      output_url_escaped(out, e->name);
+      fprintf(out, "%s\">", slash);
+      output_html_escaped(out, e->name);
+      fprintf(out, "%s</a></td><td>%s</td><td>", slash, date);
+      if (e->is_dir) {
+        fprintf(out, "-</td></tr>\n");
+      } else {
+        fprintf(out, "%ld</td></tr>\n", e->size);
+      }
+    }
+    fprintf(out, "</table>\n</body>\n</html>\n");
+  }
+  for (size_t i = 0; i < nentries; ++i) free(entries[i].name);
+  free(entries);
+  return ret;
+}
+
+// Directories first, then by name.
+static int compare_listing_entries(const void* a, const void* b) {
+  const struct ListingEntry* x = a;
+  const struct ListingEntry* y = b;
+  if (x->is_dir != y->is_dir) return y->is_dir - x->is_dir;
+  return strcmp(x->name, y->name);
+}
+
+static void output_html_escaped(FILE* out, const char* s) {
+  for (; *s; ++s) {
+    switch (*s) {
+      case '&':
+        fputs("&amp;", out);
+        break;
+      case '<':
+        fputs("&lt;", out);
+        break;
+      case '>':
+        fputs("&gt;", out);
+        break;
+      case '"':
+        fputs("&quot;", out);
+        break;
+      default:
+        fputc(*s, out);
+    }
+  }
+}
+
+// Percent-encodes everything but unreserved characters (RFC 3986).
+static void output_url_escaped(FILE* out, const char* s) {
+  for (; *s; ++s) {
+    unsigned char c = *s;
+    if (isalnum(c) || strchr("-._~", c)) {
+      fputc(c, out);
+    } else {
+      fprintf(out, "%%%02X", c);
+    }
+  }
+}
+
+// Evicts cached files that changed on disk.
+static void handle_file_events(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t n = read(inotify_fd, buf, sizeof buf);
+    if (n <= 0) return;
+    struct inotify_event* ev;
+    for (char* p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+      ev = (struct inotify_event*)p;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        for (struct WatchedDir* dir = watched_dirs; dir; dir = dir->next) {
+          ++dir->changes;
+        }
+        while (lru_head) evict_cached_file(lru_head);
+        continue;
+      }
+      struct WatchedDir* dir = watched_dirs;
+      while (dir && dir->wd != ev->wd) dir = dir->next;
+      if (!dir) continue;
+      ++dir->changes;
+      for (struct CachedFile* f = dir->files; f;) {
+        struct CachedFile* next = f->dir_next;
+        if (!ev->len || affects_cached_file(f, ev->name)) {
+          evict_cached_file(f);
+        }
+        f = next;
+      }
+    }
+  }
+}
+
+static int file_jobs_fd = -1;
+static pthread_mutex_t file_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t file_jobs_added = PTHREAD_COND_INITIALIZER;
+static struct FileJob* file_jobs_head = NULL;
+static struct FileJob* file_jobs_tail = NULL;
+static struct FileJob* file_jobs_done = NULL;
+
+// Starts the I/O threads, which take the opening and reading of files that
+// miss the cache off the event loop, so that a cold file on a slow disk only
+// holds up the connection asking for it. At most io_threads files are read
+// at once; each connection waits for one at a time. Finished jobs are
+// signaled to the event loop through an eventfd. With io_uring, files are
+// loaded on the ring instead and no threads are needed.
+static void start_file_jobs(void) {
+  if (!io_threads) return;
+  file_jobs_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (file_jobs_fd < 0) log_exit("eventfd(2) failed: %s", strerror(errno));
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (int i = 0; i < io_threads; ++i) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, run_file_jobs, NULL);
+    if (err) log_exit("pthread_create(3) failed: %s", strerror(err));
+    pthread_detach(thread);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void* run_file_jobs(void* arg) {
+  for (;;) {
+    pthread_mutex_lock(&file_jobs_lock);
+    while (!file_jobs_head) {
+      pthread_cond_wait(&file_jobs_added, &file_jobs_lock);
+    }
+    struct FileJob* job = file_jobs_head;
+    file_jobs_head = job->next;
+    if (!file_jobs_head) file_jobs_tail = NULL;
+    pthread_mutex_unlock(&file_jobs_lock);
+
+    if (job->urlpath) {
+      job->file = load_file(job->urlpath);
+      if (!job->file) job->err = errno;
+    } else {
+      read_ahead(job);
+    }
+
+    pthread_mutex_lock(&file_jobs_lock);
+    job->next = file_jobs_done;
+    file_jobs_done = job;
+    pthread_mutex_unlock(&file_jobs_lock);
+    uint64_t one = 1;
+    if (write(file_jobs_fd, &one, sizeof one) < 0) {
+      log_error("failed to signal the event loop: %s", strerror(errno));
+    }
+  }
+  return NULL;
+}
+
+// Returns a reference to the file behind urlpath like open_cached_file().
+// With I/O threads or io_uring, a file that is not cached is loaded off the
+// event loop instead: errno is then EINPROGRESS, and conn->resume is to be
+// set to the function serving the request again once it is done, when this
+// returns the outcome of the load.
+static struct CachedFile* open_file(struct Connection* conn, char* urlpath) {
+  struct FileJob* job = conn->job;
+  if (job && job->done && !strcmp(job->urlpath, urlpath)) {
+    if (!job->file) {
+      errno = job->err;
+      return NULL;
+    }
+    ++job->file->refs;
+    return job->file;
+  }
+  if (!io_threads) {
+    return open_cached_file(&conn->arena, conn->docroot, urlpath);
+  }
+  struct CachedFile* f = lookup_cached_file(urlpath, 0);
+  if (f) return f;
+  start_file_job(conn, urlpath);
+  errno = EINPROGRESS;
+  return NULL;
+}
+
+static void start_file_job(struct Connection* conn, char* urlpath) {
+  drop_file_job(conn);
+  stat_add(&stats->cache_misses, 1);
+  struct FileJob* job = xmalloc(sizeof(struct FileJob));
+  job->conn = conn;
+  job->urlpath = strdup(urlpath);
+  if (!job->urlpath) log_exit("failed to allocate memory");
+  // Watched before the file is opened, as in open_cached_file().
+  job->dir = watch_directory(&conn->arena, conn->docroot, urlpath);
+  if (job->dir) {
+    ++job->dir->loads;
+    job->dir_changes = job->dir->changes;
+  }
+  job->file = NULL;
+  job->err = 0;
+  job->done = 0;
+  job->next = NULL;
+  conn->job = job;
+  if (use_io_uring) {
+    uring_load_file(job);
+    return;
+  }
+  queue_file_job(job);
+}
+
+// Hands job to the I/O threads.
+static void queue_file_job(struct FileJob* job) {
+  pthread_mutex_lock(&file_jobs_lock);
+  if (file_jobs_tail) {
+    file_jobs_tail->next = job;
+  } else {
+    file_jobs_head = job;
+  }
+  file_jobs_tail = job;
+  pthread_cond_signal(&file_jobs_added);
+  pthread_mutex_unlock(&file_jobs_lock);
+}
+
+static const off_t READ_AHEAD_SIZE = 4 << 20;
+
+// Has the next window of the file body read in on an I/O thread, parking
+// the connection until it is done. Even a hot body goes through the threads
+// a window at a time, as the event loop cannot tell whether sendfile(2)
+// would have to wait for the disk.
+static void start_read_ahead(struct Connection* conn) {
+  drop_file_job(conn);
+  struct FileJob* job = xmalloc(sizeof(struct FileJob));
+  job->conn = conn;
+  job->urlpath = NULL;
+  job->dir = NULL;
+  job->file = conn->file;
+  ++job->file->refs;
+  job->offset = conn->file_offset;
+  job->len = conn->file_remaining < READ_AHEAD_SIZE ? conn->file_remaining
+                                                     : READ_AHEAD_SIZE;
+  job->err = 0;
+  job->done = 0;
+  job->next = NULL;
+  conn->job = job;
+  queue_file_job(job);
+}
+
+// Reads the window of job into the page cache: readahead(2) starts reading
+// all of it at once, and mapping it with MAP_POPULATE waits for every page.
+// Failures are left to the send.
+static void read_ahead(struct FileJob* job) {
+  int fd = job->file->fd;
+  readahead(fd, job->offset, job->len);
+  off_t start = job->offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+  size_t len = job->offset + job->len - start;
+  void* p = mmap(NULL, len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, start);
+  if (p != MAP_FAILED) munmap(p, len);
+}
+
+// Carries on sending the file body once its next window has been read in.
+static void finish_read_ahead(struct FileJob* job) {
+  struct Connection* conn = job->conn;
+  job->done = 1;
+  if (!conn) {
+    release_cached_file(job->file);
+    free(job);
+    return;
+  }
+  conn->ready_from = job->offset;
+  conn->ready_to = job->offset + job->len;
+  drop_file_job(conn);
+  handle_writable(conn);
+}
+
+// Completes the jobs the I/O threads are done with.
+static void finish_file_jobs(void) {
+  uint64_t n;
+  if (read(file_jobs_fd, &n, sizeof n) < 0) return;
+  pthread_mutex_lock(&file_jobs_lock);
+  struct FileJob* job = file_jobs_done;
+  file_jobs_done = NULL;
+  pthread_mutex_unlock(&file_jobs_lock);
+  while (job) {
+    struct FileJob* next = job->next;
+    complete_file_job(job);
+    job = next;
+  }
+}
+
+// Caches the file loaded by job and resumes the request waiting for it, or
+// frees the job if the connection is gone. A file is served but not cached if
+// its directory changed while it was loaded, or if another load of it got
+// there first.
+static void complete_file_job(struct FileJob* job) {
+  if (!job->urlpath) {
+    finish_read_ahead(job);
+    return;
+  }
+  struct WatchedDir* dir = job->dir;
+  job->done = 1;
+  if (dir) --dir->loads;
+  if (job->file && dir && dir->changes == job->dir_changes &&
+      !find_cached_file(job->urlpath, 0)) {
+    insert_cached_file(job->file, dir);
+  } else if (dir && !dir->files) {
+    prune_watched_dirs();
+  }
+  if (job->conn) {
+    resume_request(job->conn);
+  } else {
+    if (job->file) release_cached_file(job->file);
+    free(job->urlpath);
+    free(job);
+  }
+}
+
+static int waiting_for_file(struct Connection* conn) {
+  return conn->job && !conn->job->done;
+}
+
+// Lets go of the connection's load: one in flight is left to finish on its
+// own, a finished one is freed.
+static void drop_file_job(struct Connection* conn) {
+  struct FileJob* job = conn->job;
+  if (!job) return;
+  conn->job = NULL;
+  if (!job->done) {
+    job->conn = NULL;
+    return;
+  }
+  if (job->file) release_cached_file(job->file);
+  free(job->urlpath);
+  free(job);
+}
+
+static const char STATS_PATH[] = "/__stats";
+
+static void respond_to(struct HTTPRequest* req, struct Connection* conn) {
+  int get = !strcmp(req->method, "GET") || !strcmp(req->method, "HEAD");
+  if (get && !strcmp(req->path, STATS_PATH)) {
+    do_stats_response(req, conn);
+  } else if (!strcmp(req->method, "GET")) {
+    do_file_response(req, conn);
+  } else if (!strcmp(req->method, "HEAD")) {
+    do_file_response(req, conn);
+  } else if (is_upload(req)) {
+    do_upload_response(req, conn);
+  } else if (!strcmp(req->method, "POST")) {
+    method_not_allowed(req, conn);
+  } else {
+    not_implemented(req, conn);
+  }
+}
+
+// Queues the response header. The body is sent from conn->file_fd by
+// handle_writable() as the socket drains.
+static void do_file_response(struct HTTPRequest* req,
+                             struct Connection* conn) {
+  if (do_not_modified_response(req, conn, req->path)) return;
+  struct CachedFile* f = open_file(conn, req->path);
+  if (f) {
+    serve_file(req, conn, req->path, f);
+  } else if (errno == EINPROGRESS) {
+    conn->resume = do_file_response;
+  } else if (errno == EISDIR) {
+    do_directory_response(req, conn);
+  } else {
+    file_error(req, conn, req->path);
+  }
+}
+
+static const char INDEX_FILE[] = "index.html";
+
+// Redirects a directory URL to its slash-terminated form, which relative
+// links resolve against, and serves the index file there, or failing that a
+// listing if --autoindex is given.
+static void do_directory_response(struct HTTPRequest* req,
+                                  struct Connection* conn) {
+  size_t len = strlen(req->path);
+  if (req->path[len - 1] != '/') {
+    moved_permanently(req, conn);
+    return;
+  }
+  char* index = arena_alloc(&conn->arena, len + sizeof INDEX_FILE);
+  sprintf(index, "%s%s", req->path, INDEX_FILE);
+  if (do_not_modified_response(req, conn, index)) return;
+  struct CachedFile* f = open_file(conn, index);
+  if (f) {
+    serve_file(req, conn, index, f);
+    return;
+  }
+  if (errno == EINPROGRESS) {
+    conn->resume = do_directory_response;
+    return;
+  }
+  if (errno != ENOENT || !autoindex_enabled) {
+    file_error(req, conn, index);
+    return;
+  }
+  f = open_directory_listing(&conn->arena, conn->docroot, req->path);
+  if (f) {
+    serve_file(req, conn, req->path, f);
+  } else {
+    file_error(req, conn, req->path);
+  }
+}
+
+// Answers for a file that could not be opened, going by errno.
+static void file_error(struct HTTPRequest* req, struct Connection* conn,
+                       char* urlpath) {
+  if (errno == EACCES || errno == EPERM) {
+    forbidden(req, conn);
+  } else if (errno == ENOENT || errno == ENOTDIR || errno == ELOOP ||
+             errno == ENAMETOOLONG || errno == EISDIR || errno == EXDEV) {
+    not_found(req, conn);
+  } else {
+    log_error("failed to open %s: %s", urlpath, strerror(errno));
+    internal_error(req, conn);
+  }
+}
+
+// Queues the response for f, the file behind urlpath. Takes over the
+// caller's reference to f.
+static void serve_file(struct HTTPRequest* req, struct Connection* conn,
+                       char* urlpath, struct CachedFile* f) {
+  char* range = req->header[HEADER_RANGE];
+  if (range && !strcmp(req->method, "GET") && if_range_matches(req, f)) {
+    struct ByteRange ranges[16];
+    int n = parse_ranges(range, f->size, ranges,
+                         sizeof ranges / sizeof ranges[0]);
+    if (n >= 0) {
+      do_range_response(req, conn, f, ranges, n);
+      return;
+    }
+  }
+  if (accepts_gzip(req)) {
+    struct CachedFile* gz =
+        open_gzip_file(&conn->arena, conn->docroot, urlpath, f);
+    if (gz) {
+      release_cached_file(f);
+      f = gz;
+    }
+  }
+  output_common_header_fields(req, conn, "200 OK");
+  if (!strcmp(req->method, "HEAD")) {
+    output_bytes(conn, f->header, f->header_len + 2);
+    release_cached_file(f);
+    return;
+  }
+  conn->response_length = f->size;
+  if (f->body) {
+    output_body(conn, f->header, f->header_len + 2 + f->size, f);
+    return;
+  }
+  output_bytes(conn, f->header, f->header_len + 2);
+  conn->file = f;
+  conn->file_fd = f->fd;
+  conn->file_offset = 0;
+  conn->file_remaining = f->size;
+}
+
+// Answers a conditional request with 304 if the client's copy is current.
+// If-None-Match is matched against both encodings of the file; only without
+// it is If-Modified-Since looked at, against the encoding to be sent. The
+// validators come from the cache or from lstat(2), so the file is never
+// opened. Returns 0 if a full response is needed.
+static int do_not_modified_response(struct HTTPRequest* req,
+                                    struct Connection* conn, char* urlpath) {
+  char* if_none_match = req->header[HEADER_IF_NONE_MATCH];
+  char* if_modified_since = req->header[HEADER_IF_MODIFIED_SINCE];
+  if (!if_none_match && !if_modified_since) return 0;
+  char etag[64];
+  time_t mtime;
+  int no_gzip = 0;
+  struct CachedFile* f = lookup_cached_file(urlpath, 0);
+  struct FileJob* job = conn->job;
+  if (!f && job && job->done && job->file && !strcmp(job->urlpath, urlpath)) {
+    f = job->file;
+    ++f->refs;
+  }
+  if (f) {
+    snprintf(etag, sizeof etag, "%s", f->etag);
+    mtime = f->mtime;
+    no_gzip = f->no_gzip;
+    release_cached_file(f);
+  } else if (io_threads) {
+    // Left to the load, which is checked again once it is done.
+    return 0;
+  } else {
+    // Looked up like the file itself, so that nothing outside the docroot
+    // shows through.
+    int fd = open_beneath(urlpath, O_PATH | O_NOFOLLOW, 0);
+    if (fd < 0) return 0;
+    struct stat st;
+    int err = check_file_type(fd, &st);
+    close(fd);
+    if (err) return 0;
+    format_etag(etag, sizeof etag, st.st_ino, st.st_size, st.st_mtime);
+    mtime = st.st_mtime;
+  }
+  // A gzip variant from a precompressed sibling has validators of its own,
+  // known once it is cached.
+  char gzip_etag[64];
+  time_t gzip_mtime = mtime;
+  struct CachedFile* gz = find_cached_file(urlpath, 1);
+  if (gz && gz->base_mtime == mtime) {
+    snprintf(gzip_etag, sizeof gzip_etag, "%s", gz->etag);
+    gzip_mtime = gz->mtime;
+  } else {
+    gz = NULL;
+    format_gzip_etag(gzip_etag, sizeof gzip_etag, etag);
+  }
+  char* current = NULL;
+  if (if_none_match) {
+    if (etag_matches(if_none_match, etag)) {
+      current = etag;
+    } else if (etag_matches(if_none_match, gzip_etag)) {
+      current = gzip_etag;
+      mtime = gzip_mtime;
+    }
+  } else {
+    // The gzip variant to be sent could come from a sibling newer than the
+    // file, so it is only compared once it is cached.
+    int gzip = accepts_gzip(req) && !no_gzip;
+    time_t since = parse_http_date(if_modified_since);
+    if (gzip && gz) mtime = gzip_mtime;
+    if (since != -1 && mtime <= since && (!gzip || gz)) {
+      current = gzip ? gzip_etag : etag;
+    }
+  }
+  if (!current) return 0;
+  char last_modified[32];
+  format_http_date(last_modified, sizeof last_modified, mtime);
+  output_common_header_fields(req, conn, "304 Not Modified");
+  output(conn, "ETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\n\r\n",
+         current, last_modified);
+  return 1;
+}
+
+static const char* RANGE_PART_FORMAT =
+    "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n";
+static const char* RANGE_END_FORMAT = "\r\n--%s--\r\n";
+
+// Separates the parts of multipart/byteranges bodies.
+static char range_boundary[40];
+
+// Queues a 206 response for the ranges of f, or a 416 one if there are
+// none. A single range is sent like a whole file, from memory or with an
+// offset into the file; multiple ones become a multipart/byteranges body
+// whose parts are queued one at a time by output_next_range(). Takes over
+// the caller's reference to f.
+static void do_range_response(struct HTTPRequest* req, struct Connection* conn,
+                              struct CachedFile* f, struct ByteRange* ranges,
+                              int nranges) {
+  if (nranges == 0) {
+    output_common_header_fields(req, conn, "416 Range Not Satisfiable");
+    output(conn, "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n",
+           f->size);
+    release_cached_file(f);
+    return;
+  }
+  output_common_header_fields(req, conn, "206 Partial Content");
+  if (nranges == 1) {
+    long len = ranges[0].last - ranges[0].first + 1;
+    output(conn,
+           "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n"
+           "Content-Type: %s\r\nLast-Modified: %s\r\nETag: %s\r\n"
+           "Vary: Accept-Encoding\r\n\r\n",
+           ranges[0].first, ranges[0].last, f->size, len, f->content_type,
+           f->last_modified, f->etag);
+    conn->response_length = len;
+    if (f->body) {
+      output_body(conn, f->body + ranges[0].first, len, f);
+      return;
+    }
+    conn->file = f;
+    conn->file_fd = f->fd;
+    conn->file_offset = ranges[0].first;
+    conn->file_remaining = len;
+    return;
+  }
+  if (!range_boundary[0]) {
+    snprintf(range_boundary, sizeof range_boundary, "%08lx%08lx",
+             (unsigned long)getpid(), (unsigned long)time(NULL));
+  }
+  long len = snprintf(NULL, 0, RANGE_END_FORMAT, range_boundary);
+  for (int i = 0; i < nranges; ++i) {
+    len += snprintf(NULL, 0, RANGE_PART_FORMAT, range_boundary,
+                    f->content_type, ranges[i].first, ranges[i].last, f->size);
+    len += ranges[i].last - ranges[i].first + 1;
+  }
+  output(conn,
+         "Content-Length: %ld\r\n"
+         "Content-Type: multipart/byteranges; boundary=%s\r\n"
+         "Last-Modified: %s\r\nETag: %s\r\nVary: Accept-Encoding\r\n\r\n",
+         len, range_boundary, f->last_modified, f->etag);
+  conn->response_length = len;
+  conn->file = f;
+  conn->ranges = arena_alloc(&conn->arena, sizeof(struct ByteRange) * nranges);
+  memcpy(conn->ranges, ranges, sizeof(struct ByteRange) * nranges);
+  conn->nranges = nranges;
+  conn->range_index = 0;
+  output_next_range(conn);
+}
+
+// Queues the next part of a multipart/byteranges body, or its closing
+// delimiter once all parts have been queued. Parts of files in memory are
+// queued as bodies; others are sent from conn->file_fd.
+static void output_next_range(struct Connection* conn) {
+  struct CachedFile* f = conn->file;
+  if (conn->range_index == conn->nranges) {
+    output(conn, RANGE_END_FORMAT, range_boundary);
+    conn->ranges = NULL;
+    return;
+  }
+  struct ByteRange* r = &conn->ranges[conn->range_index++];
+  output(conn, RANGE_PART_FORMAT, range_boundary, f->content_type, r->first,
+         r->last, f->size);
+  if (f->body) {
+    output_body(conn, f->body + r->first, r->last - r->first + 1, NULL);
+    return;
+  }
+  conn->file_fd = f->fd;
+  conn->file_offset = r->first;
+  conn->file_remaining = r->last - r->first + 1;
+}
+
+// Moves a completely received upload into place and reports the outcome:
+// 201 for a new file, 204 for a replaced one.
+static void do_upload_response(struct HTTPRequest* req,
+                               struct Connection* conn) {
+  int err = conn->upload_error;
+  int existed = 0;
+  if (!err) {
+    const char* path = docroot_relative(req->path);
+    const char* tmp = docroot_relative(conn->upload_path);
+    struct stat st;
+    existed = fstatat(docroot_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    int ret = close(conn->upload_fd);
+    conn->upload_fd = -1;
+    if (ret < 0 || renameat(docroot_fd, tmp, docroot_fd, path) < 0) {
+      err = errno;
+      unlinkat(docroot_fd, tmp, 0);
+    }
+  }
+  abort_upload(conn);
+  char* status;
+  switch (err) {
+    case 0:
+      status = existed ? "204 No Content" : "201 Created";
+      break;
+    case ENOENT:
+    case ENOTDIR:
+      status = "404 Not Found";
+      break;
+    case EACCES:
+    case EPERM:
+    case EISDIR:
+    case EROFS:
+    case EXDEV:
+    case ELOOP:
+      status = "403 Forbidden";
+      break;
+    default:
+      log_error("failed to store %s: %s", req->path, strerror(err));
+      status = "500 Internal Server Error";
+      break;
+  }
+  output_common_header_fields(req, conn, status);
+  if (!err && existed) {
+    output(conn, "\r\n");
+    return;
+  }
+  if (!err) {
+    output(conn, "Location: %s\r\n", escape_path(&conn->arena, req->path));
+  }
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+}
+
+// Serves the sum of every worker's counters in the Prometheus text format.
+// Slots are read while their owners keep updating them, so the figures of
+// different counters may be a few requests apart.
+static void do_stats_response(struct HTTPRequest* req,
+                              struct Connection* conn) {
+  char* body;
+  size_t len;
+  FILE* out = open_memstream(&body, &len);
+  if (!out) {
+    log_error("open_memstream(3) failed: %s", strerror(errno));
+    internal_error(req, conn);
+    return;
+  }
+  output_stats(out);
+  fclose(out);
+  output_common_header_fields(req, conn, "200 OK");
+  output(conn, "Content-Length: %zu\r\n", len);
+  output(conn, "Content-Type: text/plain; version=0.0.4\r\n");
+  output(conn, "Cache-Control: no-store\r\n");
+  output(conn, "\r\n");
+  if (strcmp(req->method, "HEAD")) {
+    output_bytes(conn, body, len);
+    conn->response_length = len;
+  }
+  free(body);
+}
+
+static const char* STAGE_NAMES[] = {"parse", "first_byte", "send"};
+
+static void output_stats(FILE* out) {
+  struct WorkerStats* s;
+  fprintf(out, "# TYPE myhttpd_responses_total counter\n");
+  int ncodes = sizeof s->responses / sizeof s->responses[0];
+  for (int i = 0; i < ncodes; ++i) {
+    unsigned long n = 0;
+    for (s = worker_stats; s < worker_stats + nstats_slots; ++s) {
+      n += stat_load(&s->responses[i]);
+    }
+    if (n) {
+      fprintf(out, "myhttpd_responses_total{code=\"%d\"} %lu\n", i + 100, n);
+    }
+  }
+
+  unsigned long sent = 0, accepted = 0, accept_errors = 0, memory_hits = 0,
+                fd_hits = 0, misses = 0, dropped = 0;
+  fprintf(out, "# TYPE myhttpd_connections_active gauge\n");
+  for (s = worker_stats; s < worker_stats + nstats_slots; ++s) {
+    sent += stat_load(&s->bytes_sent);
+    accepted += stat_load(&s->connections_accepted);
+    accept_errors += stat_load(&s->accept_errors);
+    memory_hits += stat_load(&s->cache_memory_hits);
+    fd_hits += stat_load(&s->cache_fd_hits);
+    misses += stat_load(&s->cache_misses);
+    dropped += stat_load(&s->access_log_dropped);
+    fprintf(out, "myhttpd_connections_active{worker=\"%d\"} %lu\n",
+            (int)(s - worker_stats), stat_load(&s->connections_active));
+  }
+  fprintf(out, "# TYPE myhttpd_sent_bytes_total counter\n");
+  fprintf(out, "myhttpd_sent_bytes_total %lu\n", sent);
+  fprintf(out, "# TYPE myhttpd_connections_accepted_total counter\n");
+  fprintf(out, "myhttpd_connections_accepted_total %lu\n", accepted);
+  fprintf(out, "# TYPE myhttpd_accept_errors_total counter\n");
+  fprintf(out, "myhttpd_accept_errors_total %lu\n", accept_errors);
+  unsigned long overflows, listen_drops;
+  if (read_listen_drops(&overflows, &listen_drops) == 0) {
+    fprintf(out, "# TYPE myhttpd_listen_overflows_total counter\n");
+    fprintf(out, "myhttpd_listen_overflows_total %lu\n", overflows);
+    fprintf(out, "# TYPE myhttpd_listen_drops_total counter\n");
+    fprintf(out, "myhttpd_listen_drops_total %lu\n", listen_drops);
+  }
+  fprintf(out, "# TYPE myhttpd_file_cache_lookups_total counter\n");
+  fprintf(out, "myhttpd_file_cache_lookups_total{result=\"memory_hit\"} %lu\n",
+          memory_hits);
+  fprintf(out, "myhttpd_file_cache_lookups_total{result=\"fd_hit\"} %lu\n",
+          fd_hits);
+  fprintf(out, "myhttpd_file_cache_lookups_total{result=\"miss\"} %lu\n",
+          misses);
+
+  fprintf(out, "# TYPE myhttpd_access_log_dropped_total counter\n");
+  fprintf(out, "myhttpd_access_log_dropped_total %lu\n", dropped);
+  fprintf(out, "# TYPE myhttpd_stage_duration_seconds histogram\n");
+  int nbuckets = sizeof s->latency[0] / sizeof s->latency[0][0];
+  for (int stage = 0; stage < NUM_STAGES; ++stage) {
+    const char* name = STAGE_NAMES[stage];
+    unsigned long count = 0, usec = 0;
+    for (int i = 0; i < nbuckets; ++i) {
+      for (s = worker_stats; s < worker_stats + nstats_slots; ++s) {
+        count += stat_load(&s->latency[stage][i]);
+      }
+      if (i < nbuckets - 1) {
+        fprintf(out,
+                "myhttpd_stage_duration_seconds_bucket"
+                "{stage=\"%s\",le=\"%.9g\"} %lu\n",
+                name, (1L << i) / 1e6, count);
+      }
+    }
+    for (s = worker_stats; s < worker_stats + nstats_slots; ++s) {
+      usec += stat_load(&s->latency_usec[stage]);
+    }
+    fprintf(out,
+            "myhttpd_stage_duration_seconds_bucket"
+            "{stage=\"%s\",le=\"+Inf\"} %lu\n",
+            name, count);
+    fprintf(out, "myhttpd_stage_duration_seconds_sum{stage=\"%s\"} %g\n",
+            name, usec / 1e6);
+    fprintf(out, "myhttpd_stage_duration_seconds_count{stage=\"%s\"} %lu\n",
+            name, count);
+  }
+}
+
+static void method_not_allowed(struct HTTPRequest* req,
+                               struct Connection* conn) {
+  output_common_header_fields(req, conn, "405 Method Not Allowed");
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+}
+
+static void not_implemented(struct HTTPRequest* req, struct Connection* conn) {
+  output_common_header_fields(req, conn, "400 Bad Request");
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+}
+
+static void moved_permanently(struct HTTPRequest* req,
+                              struct Connection* conn) {
+  output_common_header_fields(req, conn, "301 Moved Permanently");
+  output(conn, "Location: %s/\r\n", escape_path(&conn->arena, req->path));
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+}
+
+static void not_found(struct HTTPRequest* req, struct Connection* conn) {
+  output_common_header_fields(req, conn, "404 Not Found");
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+}
+
+static void forbidden(struct HTTPRequest* req, struct Connection* conn) {
+  output_common_header_fields(req, conn, "403 Forbidden");
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+}
+
+static void internal_error(struct HTTPRequest* req, struct Connection* conn) {
+  output_common_header_fields(req, conn, "500 Internal Server Error");
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+}
+
+static const int HTTP_MINOR_VERSION = 1;
+static const char* SERVER_VERSION = "1.0";
+
+// The status line prefix and the header fields every response starts with,
+// indexed by conn->keep_alive. Only the Date changes, so they are rendered
+// at most once per second.
+static char status_line_prefix[16];
+static size_t status_line_prefix_len;
+static char common_header_fields[2][128];
+static size_t common_header_fields_len[2];
+static time_t common_header_fields_time = -1;
+
+static void output_common_header_fields(struct HTTPRequest* req,
+                                        struct Connection* conn, char* status) {
+  if (common_header_fields_time != current_time) {
+    render_common_header_fields();
+  }
+  int code = atoi(status);
+  if (code >= 100 && code < 600) stat_add(&stats->responses[code - 100], 1);
+  conn->response_status = code;
+  conn->response_length = 0;
+  output_bytes(conn, status_line_prefix, status_line_prefix_len);
+  output_bytes(conn, status, strlen(status));
+  output_bytes(conn, "\r\n", 2);
+  output_bytes(conn, common_header_fields[conn->keep_alive],
+               common_header_fields_len[conn->keep_alive]);
+}
+
+static void render_common_header_fields(void) {
+  char date[64];
+  format_http_date(date, sizeof date, current_time);
+  status_line_prefix_len =
+      snprintf(status_line_prefix, sizeof status_line_prefix, "HTTP/1.%d ",
+               HTTP_MINOR_VERSION);
+  for (int keep_alive = 0; keep_alive < 2; ++keep_alive) {
+    common_header_fields_len[keep_alive] = snprintf(
+        common_header_fields[keep_alive], sizeof common_header_fields[0],
+        "Date: %s\r\nServer: %s/%s\r\nConnection: %s\r\n", date, SERVER_NAME,
+        SERVER_VERSION, keep_alive ? "keep-alive" : "close");
+  }
+  common_header_fields_time = current_time;
+}
+
+// Appends formatted text to the connection's output buffer, growing it as
+// needed.
+static void output(struct Connection* conn, const char* fmt, ...) {
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = conn->ocap - conn->olen;
+    int n = vsnprintf(conn->obuf + conn->olen, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) log_exit("vsnprintf() failed");
+    if ((size_t)n < room) {
+      conn->olen += n;
+      return;
+    }
+    conn->ocap = (conn->olen + n + 1) * 2;
+    conn->obuf = realloc(conn->obuf, conn->ocap);
+    if (!conn->obuf) log_exit("failed to allocate memory");
+  }
+}
+
+static void output_bytes(struct Connection* conn, const char* data,
+                         size_t len) {
+  if (conn->olen + len > conn->ocap) {
+    conn->ocap = (conn->olen + len) * 2;
+    conn->obuf = realloc(conn->obuf, conn->ocap);
+    if (!conn->obuf) log_exit("failed to allocate memory");
+  }
+  memcpy(conn->obuf + conn->olen, data, len);
+  conn->olen += len;
+}
+
+// Queues a body that is already in memory without copying it. The
+// connection takes over the caller's reference to file, if any.
+static void output_body(struct Connection* conn, const char* data, size_t len,
+                        struct CachedFile* file) {
+  struct OutputBody* b = &conn->bodies[conn->nbodies++];
+  b->pos = conn->olen;
+  b->data = data;
+  b->len = len;
+  b->file = file;
+  conn->bodies_len += len;
+}
+
+// Returns true if no further response can be queued before the output has
+// been sent.
+static int output_full(struct Connection* conn) {
+  return conn->file ||
+         conn->nbodies == sizeof conn->bodies / sizeof conn->bodies[0];
+}
+
+// Used when the mime.types file cannot be read.
+static const char* BUILTIN_MIME_TYPES[] = {
+    "text/html html htm",
+    "text/css css",
+    "text/plain txt",
+    "text/javascript js mjs",
+    "application/json json",
+    "application/xml xml",
+    "application/pdf pdf",
+    "application/wasm wasm",
+    "image/png png",
+    "image/jpeg jpeg jpg",
+    "image/gif gif",
+    "image/svg+xml svg",
+    "image/webp webp",
+    "image/x-icon ico",
+    "font/woff woff",
+    "font/woff2 woff2",
+    "video/mp4 mp4",
+    NULL,
+};
+
+static char DEFAULT_CONTENT_TYPE[] = "application/octet-stream";
+
+// Sorted by extension for bsearch(3). Built once at startup; cache entries
+// point at the types.
+static struct MimeType* mime_types = NULL;
+static size_t mime_types_count = 0;
+static size_t mime_types_cap = 0;
+
+static void load_mime_types(const char* path) {
+  FILE* fp = fopen(path, "r");
+  if (fp) {
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, fp) >= 0) add_mime_types(line);
+    free(line);
+    fclose(fp);
+  } else {
+    log_error("failed to open %s, using built-in types: %s", path,
+              strerror(errno));
+    for (const char** p = BUILTIN_MIME_TYPES; *p; ++p) {
+      char* line = strdup(*p);
+      if (!line) log_exit("failed to allocate memory");
+      add_mime_types(line);
+      free(line);
+    }
+  }
+  qsort(mime_types, mime_types_count, sizeof(struct MimeType),
+        compare_mime_types);
+  size_t n = 0;
+  for (size_t i = 0; i < mime_types_count; ++i) {
+    if (n > 0 && !strcmp(mime_types[n - 1].ext, mime_types[i].ext)) {
+      free(mime_types[i].ext);
+      continue;
+    }
+    mime_types[n++] = mime_types[i];
+  }
+  mime_types_count = n;
+}
+
+// Adds the mappings of one mime.types line: a type followed by extensions.
+static void add_mime_types(char* line) {
+  char* save;
+  char* type = strtok_r(line, " \t\r\n", &save);
+  if (!type || *type == '#') return;
+  char* ext = strtok_r(NULL, " \t\r\n", &save);
+  if (!ext) return;
+  type = strdup(type);
+  if (!type) log_exit("failed to allocate memory");
+  for (; ext && *ext != '#'; ext = strtok_r(NULL, " \t\r\n", &save)) {
+    if (mime_types_count == mime_types_cap) {
+      mime_types_cap = mime_types_cap ? mime_types_cap * 2 : 256;
+      mime_types =
+          realloc(mime_types, sizeof(struct MimeType) * mime_types_cap);
+      if (!mime_types) log_exit("failed to allocate memory");
+    }
+    struct MimeType* m = &mime_types[mime_types_count];
+    m->ext = strdup(ext);
+    if (!m->ext) log_exit("failed to allocate memory");
+    for (char* p = m->ext; *p; ++p) *p = tolower((unsigned char)*p);
+    m->type = type;
+    m->order = mime_types_count++;
+  }
+}
+
+static int compare_mime_types(const void* a, const void* b) {
+  const struct MimeType* x = a;
+  const struct MimeType* y = b;
+  int ret = strcmp(x->ext, y->ext);
+  // bsearch(3) keys have no type and match any mapping of their extension.
+  if (ret || !x->type || !y->type) return ret;
+  return x->order - y->order;
+}
+
+// Looks up the extension of f's name. Called once per cache miss; the result
+// is kept in the cache entry.
+static char* guess_content_type(struct FileInfo* f) {
+  char* name = strrchr(f->path, '/');
+  char* dot = strrchr(name ? name : f->path, '.');
+  if (!dot || !dot[1]) return DEFAULT_CONTENT_TYPE;
+  char ext[32];
+  size_t len = strlen(dot + 1);
+  if (len >= sizeof ext) return DEFAULT_CONTENT_TYPE;
+  for (size_t i = 0; i <= len; ++i) ext[i] = tolower((unsigned char)dot[1 + i]);
+  struct MimeType key = {ext, NULL, 0};
+  struct MimeType* m = bsearch(&key, mime_types, mime_types_count,
+                               sizeof(struct MimeType), compare_mime_types);
+  return m ? m->type : DEFAULT_CONTENT_TYPE;
+}
+
+// Listens on a dual-stack IPv6 socket, which takes IPv4 connections as
+// mapped addresses, or on IPv4 alone where the host has no IPv6.
+static int listen_socket(char* port, int reuseport) {
+  static const int families[] = {AF_INET6, AF_INET};
+  for (int i = 0; i < 2; ++i) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = families[i];
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* res;
+    int err = getaddrinfo(NULL, port, &hints, &res);
+    if (err == EAI_FAMILY || err == EAI_ADDRFAMILY) continue;
+    if (err) log_exit(gai_strerror(err));
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+      int sock = bind_listener(ai, reuseport);
+      if (sock >= 0) {
+        freeaddrinfo(res);
+        return sock;
+      }
+    }
+    freeaddrinfo(res);
+  }
+  log_exit("failed to listen socket");
+  return -1;
+}
+
+static int bind_listener(struct addrinfo* ai, int reuseport) {
+  int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (sock < 0) return -1;
+  int on = 1, off = 0;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+  if (reuseport &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+    log_exit("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+  }
+  if (ai->ai_family == AF_INET6) {
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off);
+  }
+  if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+    close(sock);
+    return -1;
+  }
+  // Connections are queued only once the request arrives, so a worker is
+  // never woken for a client that has yet to send anything.
+  if (defer_accept &&
+      setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept,
+                 sizeof defer_accept) < 0) {
+    log_error("setsockopt(TCP_DEFER_ACCEPT) failed: %s", strerror(errno));
+  }
+  if (fastopen_queue &&
+      setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue,
+                 sizeof fastopen_queue) < 0) {
+    log_error("setsockopt(TCP_FASTOPEN) failed: %s", strerror(errno));
+  }
+  if (listen(sock, listen_backlog) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static void open_netstat(void) {
+  netstat_fd = open("/proc/net/netstat", O_RDONLY | O_CLOEXEC);
+}
+
+// Reads the kernel's counts of connections refused because an accept queue
+// was full, and of those dropped at the listen stage for any reason. They
+// cover every listener in the network namespace, not only ours.
+static int read_listen_drops(unsigned long* overflows, unsigned long* drops) {
+  char buf[8192];
+  if (netstat_fd < 0) return -1;
+  ssize_t n = pread(netstat_fd, buf, sizeof buf - 1, 0);
+  if (n <= 0) return -1;
+  buf[n] = '\0';
+  // A line of TcpExt field names is followed by one of their values.
+  char* names = strstr(buf, "TcpExt:");
+  char* values = names ? strstr(names + 1, "TcpExt:") : NULL;
+  if (!values) return -1;
+  values[-1] = '\0';
+  values[strcspn(values, "\n")] = '\0';
+  *overflows = *drops = 0;
+  char *name_save, *value_save;
+  strtok_r(names, " ", &name_save);
+  strtok_r(values, " ", &value_save);
+  for (;;) {
+    char* name = strtok_r(NULL, " ", &name_save);
+    char* value = strtok_r(NULL, " ", &value_save);
+    if (!name || !value) break;
+    if (strcmp(name, "ListenOverflows") == 0) {
+      *overflows = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "ListenDrops") == 0) {
+      *drops = strtoul(value, NULL, 10);
+    }
+  }
+  return 0;
+}
+
+static const int MIN_WORKER_LIFETIME = 1;
+
+// Runs in the master process when --workers is given. Each worker owns one
+// of server_fds; the master keeps them open so that connections queued on a
+// crashed worker's socket are picked up by its replacement.
+static void supervise_workers(int* server_fds, char* doc_root) {
+  pid_t* pids = xmalloc(sizeof(pid_t) * worker_count);
+  time_t* started = xmalloc(sizeof(time_t) * worker_count);
+  sigset_t set, oldset;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &set, &oldset) < 0) {
+    log_exit("sigprocmask(2) failed: %s", strerror(errno));
+  }
+  for (int i = 0; i < worker_count; ++i) {
+    pids[i] = spawn_worker(i, server_fds, doc_root, &oldset);
+    started[i] = time(NULL);
+  }
+  for (;;) {
+    int sig = sigwaitinfo(&set, NULL);
+    if (sig < 0) {
+      if (errno == EINTR) continue;
+      log_exit("sigwaitinfo(2) failed: %s", strerror(errno));
+    }
+    if (sig == SIGUSR1 || sig == SIGHUP) {
+      // Workers forked later inherit the reopened log.
+      if (sig == SIGHUP && access_log_path) reopen_access_log();
+      for (int i = 0; i < worker_count; ++i) kill(pids[i], sig);
+      continue;
+    }
+    if (sig != SIGCHLD) {
+      for (int i = 0; i < worker_count; ++i) kill(pids[i], SIGTERM);
+      exit(0);
+    }
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (int i = 0; i < worker_count; ++i) {
+        if (pids[i] != pid) continue;
+        if (WIFSIGNALED(status)) {
+          log_error("worker %d (pid %d) killed by signal %d", i, pid,
+                    WTERMSIG(status));
+        } else {
+          log_error("worker %d (pid %d) exited with status %d", i, pid,
+                    WEXITSTATUS(status));
+        }
+        // Avoid spinning when a worker dies right after it starts.
+        if (time(NULL) - started[i] < MIN_WORKER_LIFETIME) {
+          sleep(MIN_WORKER_LIFETIME);
+        }
+        pids[i] = spawn_worker(i, server_fds, doc_root, &oldset);
+        started[i] = time(NULL);
+      }
+    }
+  }
+}
+
+static pid_t spawn_worker(int index, int* server_fds, char* doc_root,
+                          sigset_t* mask) {
+  pid_t pid = fork();
+  if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+  if (pid > 0) return pid;
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (sigprocmask(SIG_SETMASK, mask, NULL) < 0) {
+    log_exit("sigprocmask(2) failed: %s", strerror(errno));
+  }
+  for (int i = 0; i < worker_count; ++i) {
+    if (i != index) close(server_fds[i]);
+  }
+  pin_to_cpu(index);
+  // A replacement inherits the counters, but not the connections, of the
+  // worker it replaces.
+  stats = &worker_stats[index];
+  atomic_store_explicit(&stats->connections_active, 0, memory_order_relaxed);
+  server_main(server_fds[index], doc_root);
+  exit(0);
+}
+
+// Binds the calling process to the index-th CPU it is allowed to run on,
+// wrapping around when there are more workers than CPUs.
+static void pin_to_cpu(int index) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof allowed, &allowed) < 0) return;
+  int target = index % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) < 0) {
+      log_error("sched_setaffinity(2) failed: %s", strerror(errno));
+    }
+    return;
+  }
+}
+
+static const int MAX_EVENTS = 256;
+
+static int epoll_fd = -1;
+
+// Connections ordered by last activity, oldest first.
+static struct Connection* connections_head = NULL;
+static struct Connection* connections_tail = NULL;
+
+static void server_main(int server_fd, char* doc_root) {
+  set_nonblocking(server_fd);
+  init_file_cache();
+  start_access_log();
+  if (use_io_uring) {
+    if (init_uring() == 0) {
+      uring_main(server_fd, doc_root);
+      return;
+    }
+    log_error("io_uring unavailable, using epoll: %s", strerror(errno));
+    use_io_uring = 0;
+  }
+  start_file_jobs();
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) log_exit("epoll_create1(2) failed: %s", strerror(errno));
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+    log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+  }
+  if (inotify_fd >= 0) {
+    ev.data.ptr = &inotify_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev) < 0) {
+      log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+  }
+  if (file_jobs_fd >= 0) {
+    ev.data.ptr = &file_jobs_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, file_jobs_fd, &ev) < 0) {
+      log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+  }
+  for (;;) {
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = connections_head || accept_paused ? 1000 : -1;
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    handle_signal_requests();
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      log_exit("epoll_wait(2) failed: %s", strerror(errno));
+    }
+    current_time = time(NULL);
+    int jobs_done = 0;
+    for (int i = 0; i < n; ++i) {
+      struct Connection* conn = events[i].data.ptr;
+      if (!conn) {
+        accept_connections(server_fd, doc_root);
+      } else if (events[i].data.ptr == &inotify_fd) {
+        handle_file_events();
+      } else if (events[i].data.ptr == &file_jobs_fd) {
+        jobs_done = 1;
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        close_connection(conn);
+      } else if (conn->events & EPOLLOUT) {
+        handle_writable(conn);
+      } else {
+        handle_readable(conn);
+      }
+    }
+    // Only now, as resumed connections may be closed, while events for them
+    // could still follow in this batch.
+    if (jobs_done) finish_file_jobs();
+    expire_connections();
+    if (accept_paused && current_time > accept_paused) {
+      resume_accepting(server_fd);
+    }
+  }
+}
+
+// Acts on the signals caught since the last call.
+static void handle_signal_requests(void) {
+  if (stats_requested) {
+    stats_requested = 0;
+    log_cache_stats();
+  }
+  if (terminate_requested) {
+    stop_access_log();
+    exit(0);
+  }
+}
+
+static const unsigned URING_SQ_ENTRIES = 256;
+static const unsigned URING_CQ_ENTRIES = 4096;
+// Connections and jobs are allocated with malloc(3), aligned to 16 bytes.
+static const uint64_t URING_OP_MASK = 15;
+static const unsigned URING_RECV_BUFFERS = 128;
+
+static struct Uring uring = {.fd = -1};
+
+// Sets up the io_uring instance with its rings mapped. Needs Linux 6.0 for
+// IORING_SETUP_SINGLE_ISSUER, which also guarantees multishot accept and
+// poll. Returns -1 with errno set on failure.
+static int init_uring(void) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+            IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+  p.cq_entries = URING_CQ_ENTRIES;
+  int fd = syscall(SYS_io_uring_setup, URING_SQ_ENTRIES, &p);
+  if (fd < 0) return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    close(fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  char* rings = mmap(NULL, sq_size > cq_size ? sq_size : cq_size,
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (uring.sqes == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+  uring.fd = fd;
+  uring.sq_head = (unsigned*)(rings + p.sq_off.head);
+  uring.sq_tail = (unsigned*)(rings + p.sq_off.tail);
+  uring.sq_mask = *(unsigned*)(rings + p.sq_off.ring_mask);
+  uring.sq_entries = p.sq_entries;
+  uring.tail = *uring.sq_tail;
+  // Submission queue slots are used in order.
+  unsigned* array = (unsigned*)(rings + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; ++i) array[i] = i;
+  uring.cq_head = (unsigned*)(rings + p.cq_off.head);
+  uring.cq_tail = (unsigned*)(rings + p.cq_off.tail);
+  uring.cq_mask = *(unsigned*)(rings + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe*)(rings + p.cq_off.cqes);
+  init_recv_buffers();
+  return 0;
+}
+
+// Registers a ring of URING_RECV_BUFFERS input buffers as buffer group 0.
+// Each is handed back as soon as its data has been copied out, so a few
+// cover every connection. Without them, recv(2) reads into the connection's
+// own buffer as before.
+static void init_recv_buffers(void) {
+  size_t ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+  void* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (uintptr_t)ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = 0;
+  if (syscall(SYS_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    log_error("io_uring buffer ring unavailable: %s", strerror(errno));
+    munmap(ring, ring_size);
+    return;
+  }
+  uring.recv_ring = ring;
+  uring.recv_bufs = xmalloc(URING_RECV_BUFFERS * INPUT_BUF_SIZE);
+  uring.recv_tail = 0;
+  for (unsigned i = 0; i < URING_RECV_BUFFERS; ++i) provide_recv_buffer(i);
+}
+
+// Gives buffer bid back to the kernel to receive into.
+static void provide_recv_buffer(unsigned short bid) {
+  struct io_uring_buf* buf =
+      &uring.recv_ring->bufs[uring.recv_tail & (URING_RECV_BUFFERS - 1)];
+  buf->addr = (uintptr_t)(uring.recv_bufs + bid * INPUT_BUF_SIZE);
+  buf->len = INPUT_BUF_SIZE;
+  buf->bid = bid;
+  __atomic_store_n(&uring.recv_ring->tail, ++uring.recv_tail,
+                   __ATOMIC_RELEASE);
+}
+
+// Runs the event loop on io_uring. Accepts and the inotify poll are
+// multishot; each connection has a recv(2) into its input buffer in flight
+// while it waits for a request, or a poll while its socket is full. Files
+// that miss the cache are opened and read on the ring. Responses are still
+// sent right away, as a send that completes needs no
+// round trip through the ring. Every operation queued during an iteration
+// goes to the kernel with the single io_uring_enter(2) that also waits for
+// the next completions.
+static void uring_main(int server_fd, char* doc_root) {
+  uring_accept(server_fd);
+  if (inotify_fd >= 0) uring_poll(inotify_fd, URING_INOTIFY, NULL, EPOLLIN, 1);
+  for (;;) {
+    int ret = enter_uring(1, connections_head || accept_paused ? 1000 : -1);
+    handle_signal_requests();
+    if (ret < 0 && errno != EINTR && errno != ETIME) {
+      log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+    }
+    current_time = time(NULL);
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe cqe = uring.cqes[head & uring.cq_mask];
+      __atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+      handle_completion(&cqe, server_fd, doc_root);
+    }
+    expire_connections();
+    if (accept_paused && current_time > accept_paused) {
+      resume_accepting(server_fd);
+    }
+  }
+}
+
+static void handle_completion(struct io_uring_cqe* cqe, int server_fd,
+                              char* doc_root) {
+  int op = cqe->user_data & URING_OP_MASK;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  struct Connection* conn =
+      (struct Connection*)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+  switch (op) {
+    case URING_ACCEPT:
+      if (cqe->res >= 0) {
+        start_connection(cqe->res, NULL, doc_root);
+      } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+        count_accept_error(server_fd, -cqe->res);
+      }
+      if (!more && !accept_paused) uring_accept(server_fd);
+      return;
+    case URING_INOTIFY:
+      handle_file_events();
+      if (!more) uring_poll(inotify_fd, URING_INOTIFY, NULL, EPOLLIN, 1);
+      return;
+    case URING_STATX:
+    case URING_OPEN:
+    case URING_READ:
+      handle_load_completion(
+          (struct FileJob*)(uintptr_t)(cqe->user_data & ~URING_OP_MASK), op,
+          cqe->res);
+      return;
+    case URING_CANCEL:
+      return;
+  }
+  conn->uring_ops &= ~(1 << op);
+  if (op == URING_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    // The recv was limited to the room left in the input buffer, which is
+    // only allocated once there is something to keep.
+    if (!conn->closed && cqe->res > 0 && conn->state != CONN_LINGERING) {
+      if (!conn->ibuf) conn->ibuf = xmalloc(INPUT_BUF_SIZE);
+      memcpy(conn->ibuf + conn->ilen, uring.recv_bufs + bid * INPUT_BUF_SIZE,
+             cqe->res);
+    }
+    provide_recv_buffer(bid);
+  }
+  if (conn->closed) {
+    if (!conn->uring_ops) free_connection(conn);
+    return;
+  }
+  touch_connection(conn);
+  if (op == URING_RECV && cqe->res == -ENOBUFS) {
+    // Every buffer is taken: this connection reads into its own instead.
+    if (!conn->ibuf) conn->ibuf = xmalloc(INPUT_BUF_SIZE);
+    uring_recv(conn, 0);
+  } else if (op == URING_RECV) {
+    handle_received(conn, cqe->res);
+  } else if (op == URING_POLLOUT) {
+    handle_writable(conn);
+  } else {
+    handle_sent(conn, op, cqe->res);
+  }
+}
+
+// Takes the result of a send or splice(2) of the response and, once nothing
+// else is in flight for it, carries on with the response.
+static void handle_sent(struct Connection* conn, int op, int res) {
+  if (res > 0 && op == URING_SPLICE_IN) {
+    conn->piped += res;
+    conn->file_offset += res;
+    conn->file_remaining -= res;
+  } else if (res > 0) {
+    if (op == URING_SEND) {
+      conn->opos += res;
+    } else {
+      conn->piped -= res;
+    }
+    count_sent(conn, res);
+  } else if (res == -ECANCELED && op == URING_SPLICE_OUT) {
+    // The splice into the pipe came up short: the rest goes out next time.
+  } else if (res != -EAGAIN && res != -EINTR) {
+    if (op != URING_SEND) {
+      log_error("splice(2) failed: %s", res ? strerror(-res) : "short file");
+    }
+    close_connection(conn);
+    return;
+  }
+  if (uring_sending(conn)) return;
+  if (res == -EAGAIN) {
+    watch_connection(conn, EPOLLOUT);
+  } else {
+    handle_writable(conn);
+  }
+}
+
+// Returns a cleared submission queue entry for op on ptr, flushing the queue
+// to the kernel first if it is full.
+static struct io_uring_sqe* get_sqe(int op, void* ptr) {
+  if (uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) ==
+      uring.sq_entries) {
+    while (enter_uring(0, 0) < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+      }
+    }
+  }
+  struct io_uring_sqe* sqe = &uring.sqes[uring.tail++ & uring.sq_mask];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->user_data = (uintptr_t)ptr | op;
+  return sqe;
+}
+
+// Submits the queued operations and, if wait, waits for a completion for up
+// to timeout milliseconds, or without limit if timeout is negative.
+static int enter_uring(int wait, int timeout) {
+  __atomic_store_n(uring.sq_tail, uring.tail, __ATOMIC_RELEASE);
+  unsigned queued =
+      uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+  struct __kernel_timespec ts = {timeout / 1000, timeout % 1000 * 1000000L};
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof arg);
+  if (timeout >= 0) arg.ts = (uintptr_t)&ts;
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+  return syscall(SYS_io_uring_enter, uring.fd, queued, wait ? 1 : 0, flags,
+                 wait ? &arg : NULL, wait ? sizeof arg : 0);
+}
+
+static void uring_accept(int server_fd) {
+  struct io_uring_sqe* sqe = get_sqe(URING_ACCEPT, NULL);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void uring_poll(int fd, int op, void* ptr, uint32_t events,
+                       int multishot) {
+  struct io_uring_sqe* sqe = get_sqe(op, ptr);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  if (multishot) sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+// The io_uring side of watch_connection(): makes sure there is a recv(2) in
+// flight for EPOLLIN, or for EPOLLOUT a poll, unless a send is in flight and
+// waits for room itself. A connection with nothing buffered gives up its
+// input buffer while it waits.
+static int watch_connection_uring(struct Connection* conn, uint32_t events) {
+  conn->events = events;
+  if (!events) return 0;
+  if (events == EPOLLOUT) {
+    if (conn->uring_ops & (1 << URING_POLLOUT) || uring_sending(conn)) {
+      return 0;
+    }
+    uring_poll(conn->fd, URING_POLLOUT, conn, EPOLLOUT, 0);
+    conn->uring_ops |= 1 << URING_POLLOUT;
+    return 0;
+  }
+  if (conn->uring_ops & (1 << URING_RECV)) return 0;
+  if (make_input_room(conn) < 0) return -1;
+  int idle =
+      conn->state == CONN_READING_HEADER || conn->state == CONN_LINGERING;
+  if (uring.recv_ring && idle && conn->ilen == 0) {
+    free(conn->ibuf);
+    conn->ibuf = NULL;
+  }
+  uring_recv(conn, uring.recv_ring != NULL);
+  return 0;
+}
+
+// Queues a recv(2) of at most the room left in the input buffer: into a
+// provided buffer if select, otherwise into the input buffer itself.
+static void uring_recv(struct Connection* conn, int select) {
+  struct io_uring_sqe* sqe = get_sqe(URING_RECV, conn);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->len = INPUT_BUF_SIZE - conn->ilen;
+  if (select) {
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+  } else {
+    sqe->addr = (uintptr_t)(conn->ibuf + conn->ilen);
+  }
+  conn->uring_ops |= 1 << URING_RECV;
+}
+
+// Queues a sendmsg(2) of the output not sent yet.
+static void uring_sendmsg(struct Connection* conn, int flags) {
+  memset(&conn->send_msg, 0, sizeof conn->send_msg);
+  conn->send_msg.msg_iov = conn->send_iov;
+  conn->send_msg.msg_iovlen = gather_output(conn, conn->send_iov);
+  struct io_uring_sqe* sqe = get_sqe(URING_SEND, conn);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (uintptr_t)&conn->send_msg;
+  sqe->msg_flags = MSG_NOSIGNAL | flags;
+  conn->uring_ops |= 1 << URING_SEND;
+}
+
+// Returns true if a send or splice(2) of the response is in flight.
+static int uring_sending(struct Connection* conn) {
+  return conn->uring_ops &
+         (1 << URING_SEND | 1 << URING_SPLICE_IN | 1 << URING_SPLICE_OUT);
+}
+
+// Loads job on the ring in place of an I/O thread: a statx(2) with the open
+// linked behind it, so that a missing file costs no open, then a read of a
+// body that is to be kept in memory. Opened like get_fileinfo() does, except
+// that the open is already queued when the type is known; O_NONBLOCK and
+// O_NOCTTY keep it from blocking or taking over a terminal, and nothing but a
+// regular file is read.
+static void uring_load_file(struct FileJob* job) {
+  const char* path = docroot_relative(job->urlpath);
+  struct io_uring_sqe* sqe = get_sqe(URING_STATX, job);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->fd = docroot_fd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (uintptr_t)&job->stx;
+  sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+  memset(&job->how, 0, sizeof job->how);
+  job->how.flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+  job->how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+  sqe = get_sqe(URING_OPEN, job);
+  sqe->opcode = IORING_OP_OPENAT2;
+  sqe->fd = docroot_fd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = sizeof job->how;
+  sqe->off = (uintptr_t)&job->how;
+  job->fd = -1;
+  job->pending = 2;
+}
+
+// Takes the load of job a step further once op completes with res. The
+// statx(2) only stands in for the open it failed; what is served is checked
+// on the opened file itself, as it may have been replaced in between.
+static void handle_load_completion(struct FileJob* job, int op, int res) {
+  if (op == URING_READ) {
+    struct CachedFile* f = job->file;
+    if (res == f->size) {
+      close(job->fd);
+    } else {
+      f->body = NULL;
+      f->fd = job->fd;
+    }
+    complete_file_job(job);
+    return;
+  }
+  if (op == URING_STATX) {
+    job->err = res < 0 ? -res : file_type_error(job->stx.stx_mode);
+  } else {
+    job->fd = res;
+  }
+  if (--job->pending) return;
+  struct stat st;
+  int err = job->err;
+  if (job->fd >= 0) {
+    err = check_file_type(job->fd, &st);
+    if (!err && fcntl(job->fd, F_SETFL, 0) < 0) err = errno;
+    if (err) close(job->fd);
+  } else if (job->fd != -ECANCELED || !err) {
+    err = -job->fd;
+  }
+  if (err) {
+    job->err = err;
+    complete_file_job(job);
+    return;
+  }
+  struct FileInfo info = {.path = job->urlpath, .fd = job->fd,
+                          .size = st.st_size, .mtime = st.st_mtime,
+                          .ino = st.st_ino, .ok = 1};
+  struct CachedFile* f = new_file_entry(&info);
+  job->file = f;
+  if (!f->body) {
+    f->fd = job->fd;
+    complete_file_job(job);
+    return;
+  }
+  struct io_uring_sqe* sqe = get_sqe(URING_READ, job);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = job->fd;
+  sqe->addr = (uintptr_t)f->body;
+  sqe->len = f->size;
+  sqe->off = 0;
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    log_exit("fcntl(2) failed: %s", strerror(errno));
+  }
+}
+
+static void accept_connections(int server_fd, char* doc_root) {
+  for (;;) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+    int sock = accept4(server_fd, (struct sockaddr*)&addr, &addrlen,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN) count_accept_error(server_fd, errno);
+      return;
+    }
+    start_connection(sock, &addr, doc_root);
+  }
+}
+
+// Out of descriptors, the pending connection would make the listening socket
+// ready again at once; it is set aside until the next second instead.
+static void count_accept_error(int server_fd, int err) {
+  stat_add(&stats->accept_errors, 1);
+  if (err != EMFILE && err != ENFILE) {
+    log_error("accept(2) failed: %s", strerror(err));
+    return;
+  }
+  if (!accept_paused) log_error("accept(2) failed: %s", strerror(err));
+  accept_paused = current_time;
+  if (uring.fd >= 0) return;
+  struct epoll_event ev;
+  ev.events = 0;
+  ev.data.ptr = NULL;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_fd, &ev);
+}
+
+static void resume_accepting(int server_fd) {
+  accept_paused = 0;
+  if (uring.fd >= 0) {
+    uring_accept(server_fd);
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_fd, &ev) < 0) {
+    log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+  }
+}
+
+// Starts serving a nonblocking socket accepted from addr. Without addr, the
+// peer is looked up only if it is going to be logged.
+static void start_connection(int sock, struct sockaddr_storage* addr,
+                             char* doc_root) {
+  struct Connection* conn = new_connection(sock, doc_root);
+  struct sockaddr_storage peer;
+  socklen_t addrlen = sizeof peer;
+  if (!addr && access_log_path &&
+      getpeername(sock, (struct sockaddr*)&peer, &addrlen) == 0) {
+    addr = &peer;
+  }
+  strcpy(conn->peer, "-");
+  if (addr) {
+    int family = addr->ss_family;
+    void* ip = family == AF_INET6
+                   ? (void*)&((struct sockaddr_in6*)addr)->sin6_addr
+                   : (void*)&((struct sockaddr_in*)addr)->sin_addr;
+    // IPv4 clients of the dual-stack socket are logged as such.
+    if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED((struct in6_addr*)ip)) {
+      family = AF_INET;
+      ip = (char*)ip + 12;
+    }
+    if (!inet_ntop(family, ip, conn->peer, sizeof conn->peer)) {
+      strcpy(conn->peer, "-");
+    }
+  }
+  if (uring.fd >= 0) {
+    watch_connection_uring(conn, EPOLLIN);
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = conn->events;
+  ev.data.ptr = conn;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+    log_error("epoll_ctl(2) failed: %s", strerror(errno));
+    close_connection(conn);
+  }
+}
+
+static const size_t OUTPUT_BUF_SIZE = 4096;
+
+static struct Connection* new_connection(int fd, char* doc_root) {
+  struct Connection* conn = xmalloc(sizeof(struct Connection));
+  conn->fd = fd;
+  conn->state = CONN_READING_HEADER;
+  conn->events = EPOLLIN;
+  conn->docroot = doc_root;
+  // With provided buffers, allocated once there is input to keep.
+  conn->ibuf = uring.recv_ring ? NULL : xmalloc(INPUT_BUF_SIZE);
+  conn->arena.buf = xmalloc(ARENA_SIZE);
+  conn->arena.used = 0;
+  conn->arena.size = ARENA_SIZE;
+  conn->arena.chunks = NULL;
+  conn->ipos = 0;
+  conn->ilen = 0;
+  conn->nrequests = 0;
+  conn->keep_alive = 0;
+  conn->upload_fd = -1;
+  conn->upload_path = NULL;
+  conn->error_status = NULL;
+  conn->obuf = xmalloc(OUTPUT_BUF_SIZE);
+  conn->olen = 0;
+  conn->ocap = OUTPUT_BUF_SIZE;
+  conn->nbodies = 0;
+  conn->bodies_len = 0;
+  conn->opos = 0;
+  conn->file = NULL;
+  conn->ranges = NULL;
+  conn->file_fd = -1;
+  conn->use_splice = 0;
+  conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+  conn->pipe_size = 0;
+  conn->piped = 0;
+  conn->ready_from = conn->ready_to = 0;
+  conn->uring_ops = 0;
+  conn->closed = 0;
+  conn->job = NULL;
+  conn->resume = NULL;
+  conn->prev = conn->next = NULL;
+  conn->read_at = conn->request_start = monotonic_usec();
+  conn->parsed_at = conn->first_byte_at = 0;
+  stat_add(&stats->connections_accepted, 1);
+  stat_add(&stats->connections_active, 1);
+  touch_connection(conn);
+  return conn;
+}
+
+static void close_connection(struct Connection* conn) {
+  close(conn->fd);
+  stat_sub(&stats->connections_active, 1);
+  if (conn->pipe_fds[0] >= 0) {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+  }
+  abort_upload(conn);
+  drop_file_job(conn);
+  arena_reset(&conn->arena);
+  free(conn->arena.buf);
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    connections_head = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  } else {
+    connections_tail = conn->prev;
+  }
+  if (conn->uring_ops) {
+    // The operations keep the socket open and may still write to the input
+    // buffer, or send from the output, until they are canceled.
+    conn->closed = 1;
+    for (int op = URING_RECV; op <= URING_SPLICE_OUT; ++op) {
+      if (!(conn->uring_ops & (1 << op))) continue;
+      struct io_uring_sqe* sqe = get_sqe(URING_CANCEL, NULL);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (uintptr_t)conn | op;
+    }
+    return;
+  }
+  free_connection(conn);
+}
+
+// Frees a closed connection along with its output and the file the output
+// may point into.
+static void free_connection(struct Connection* conn) {
+  if (conn->file) close_file_body(conn);
+  clear_output(conn);
+  free(conn->obuf);
+  free(conn->ibuf);
+  free(conn);
+}
+
+// Returns -1 and closes the connection if it can no longer be watched.
+static int watch_connection(struct Connection* conn, uint32_t events) {
+  if (uring.fd >= 0) return watch_connection_uring(conn, events);
+  if (conn->events == events) return 0;
+  // Without any events, the socket is taken out of the epoll set altogether:
+  // errors and hangups are reported even for an empty event mask.
+  int op = EPOLL_CTL_MOD;
+  if (!events) {
+    op = EPOLL_CTL_DEL;
+  } else if (!conn->events) {
+    op = EPOLL_CTL_ADD;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = conn;
+  if (epoll_ctl(epoll_fd, op, conn->fd, &ev) < 0) {
+    log_error("epoll_ctl(2) failed: %s", strerror(errno));
+    close_connection(conn);
+    return -1;
+  }
+  conn->events = events;
+  return 0;
+}
+
+// Marks the connection as active now by moving it to the tail of the list.
+static void touch_connection(struct Connection* conn) {
+  // A lingering connection keeps the deadline it got when it was shut down.
+  if (conn->state == CONN_LINGERING) return;
+  conn->last_active = current_time;
+  if (conn == connections_tail) return;
+  if (conn->prev) conn->prev->next = conn->next;
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+    if (conn == connections_head) connections_head = conn->next;
+  }
+  conn->prev = connections_tail;
+  conn->next = NULL;
+  if (connections_tail) {
+    connections_tail->next = conn;
+  } else {
+    connections_head = conn;
+  }
+  connections_tail = conn;
+}
+
+static const int KEEPALIVE_TIMEOUT = 5;
+static const int REQUEST_TIMEOUT = 30;
+
+// Closes connections that have been idle between requests for longer than
+// KEEPALIVE_TIMEOUT, or stalled mid-request for longer than REQUEST_TIMEOUT.
+static void expire_connections(void) {
+  struct Connection* conn = connections_head;
+  while (conn && current_time - conn->last_active >= KEEPALIVE_TIMEOUT) {
+    struct Connection* next = conn->next;
+    int idle = (conn->state == CONN_READING_HEADER &&
+                conn->ipos == conn->ilen) ||
+               conn->state == CONN_LINGERING;
+    if (idle) {
+      close_connection(conn);
+    } else if (current_time - conn->last_active >= REQUEST_TIMEOUT) {
+      // A client stalled mid-request is told so, unless it is the one not
+      // reading a response.
+      if (conn->state == CONN_WRITING) {
+        close_connection(conn);
+      } else {
+        reject_request(conn, "408 Request Timeout");
+      }
+    }
+    conn = next;
+  }
+}
+
+static void handle_readable(struct Connection* conn) {
+  touch_connection(conn);
+  if (conn->state != CONN_WRITING) {
+    if (make_input_room(conn) < 0) return;
+    ssize_t n = read(conn->fd, conn->ibuf + conn->ilen,
+                     INPUT_BUF_SIZE - conn->ilen);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    handle_received(conn, n < 0 ? -errno : n);
+    return;
+  }
+  process_input(conn);
+}
+
+// Moves unprocessed input to the front of the buffer when it runs out of
+// room. Returns -1, having rejected the request, if it is still full.
+static int make_input_room(struct Connection* conn) {
+  // The header must stay put while its body is read.
+  size_t floor = conn->state == CONN_READING_BODY ? conn->body_floor : 0;
+  if (conn->ipos == conn->ilen) {
+    conn->ipos = conn->ilen = floor;
+  } else if (conn->ilen == INPUT_BUF_SIZE && conn->ipos > floor) {
+    memmove(conn->ibuf + floor, conn->ibuf + conn->ipos,
+            conn->ilen - conn->ipos);
+    conn->ilen -= conn->ipos - floor;
+    conn->ipos = floor;
+  }
+  if (conn->ilen == INPUT_BUF_SIZE) {
+    log_error("request header too long");
+    reject_request(conn, "431 Request Header Fields Too Large");
+    return -1;
+  }
+  return 0;
+}
+
+// Takes the result of reading into the end of the input buffer: a byte
+// count, 0 at end of stream or a negative errno.
+static void handle_received(struct Connection* conn, ssize_t n) {
+  if (n == -EINTR || n == -EAGAIN) {
+    watch_connection(conn, EPOLLIN);
+    return;
+  }
+  if (conn->state == CONN_LINGERING) {
+    if (n <= 0) {
+      close_connection(conn);
+    } else {
+      conn->ipos = conn->ilen = 0;
+      watch_connection(conn, EPOLLIN);
+    }
+    return;
+  }
+  if (n <= 0) {
+    if (n < 0) log_error("failed to read request: %s", strerror(-n));
+    close_connection(conn);
+    return;
+  }
+  conn->ilen += n;
+  conn->read_at = monotonic_usec();
+  // A recv(2) queued on the ring while a request was read can complete once
+  // the response to it is under way; the input then waits for the response.
+  if (conn->state == CONN_WRITING) return;
+  process_input(conn);
+}
+
+// Serves every request that is complete in the input buffer. Responses to
+// pipelined requests are queued back to back and sent together.
+static void process_input(struct Connection* conn) {
+  for (;;) {
+    if (waiting_for_file(conn)) return;
+    int ret = 1;
+    if (conn->state == CONN_READING_HEADER) {
+      ret = read_request(conn);
+      if (ret > 0) {
+        conn->state = CONN_READING_BODY;
+        begin_request_body(conn);
+      }
+    }
+    if (ret > 0) ret = read_request_body(conn);
+    if (ret < 0) {
+      reject_request(conn, conn->error_status);
+      return;
+    }
+    if (ret == 0 && conn->olen + conn->bodies_len == 0) {
+      watch_connection(conn, EPOLLIN);
+      return;
+    }
+    if (ret > 0) {
+      conn->state = CONN_WRITING;
+      service(conn);
+      if (waiting_for_file(conn)) {
+        // Queued responses go out with this one, in order.
+        watch_connection(conn, 0);
+        return;
+      }
+      if (!output_full(conn) && conn->keep_alive &&
+          find_header_end(conn->ibuf + conn->ipos, conn->ilen - conn->ipos)) {
+        conn->state = CONN_READING_HEADER;
+        continue;
+      }
+    }
+    ret = write_response(conn);
+    if (ret < 0) {
+      close_connection(conn);
+      return;
+    }
+    if (ret == 0) {
+      wait_for_output(conn);
+      return;
+    }
+    if (!finish_response(conn)) return;
+  }
+}
+
+// Gives up on the request being read. If there is a status, it is sent after
+// any responses still queued, and the connection is closed once it is out;
+// otherwise the connection is closed right away.
+static void reject_request(struct Connection* conn, char* status) {
+  abort_upload(conn);
+  if (!status) {
+    close_connection(conn);
+    return;
+  }
+  conn->keep_alive = 0;
+  conn->state = CONN_WRITING;
+  output_common_header_fields(&conn->req, conn, status);
+  output(conn, "Content-Length: 0\r\n");
+  output(conn, "\r\n");
+  log_access(conn, NULL);
+  int ret = write_response(conn);
+  if (ret < 0) {
+    close_connection(conn);
+  } else if (ret == 0) {
+    wait_for_output(conn);
+  } else {
+    finish_response(conn);
+  }
+}
+
+// Serves the request again once the file it waits for has been loaded, and
+// carries on with the connection from there.
+static void resume_request(struct Connection* conn) {
+  touch_connection(conn);
+  conn->resume(&conn->req, conn);
+  if (waiting_for_file(conn)) return;
+  drop_file_job(conn);
+  log_access(conn, &conn->req);
+  int ret = write_response(conn);
+  if (ret < 0) {
+    close_connection(conn);
+  } else if (ret == 0) {
+    wait_for_output(conn);
+  } else if (finish_response(conn)) {
+    process_input(conn);
+  }
+}
+
+static void handle_writable(struct Connection* conn) {
+  touch_connection(conn);
+  int ret = write_response(conn);
+  if (ret < 0) {
+    close_connection(conn);
+  } else if (ret == 0) {
+    wait_for_output(conn);
+  } else if (finish_response(conn)) {
+    process_input(conn);
+  }
+}
+
+// Waits for room in the socket, or for the file body to be read in.
+static void wait_for_output(struct Connection* conn) {
+  watch_connection(conn, waiting_for_file(conn) ? 0 : EPOLLOUT);
+}
+
+// Sends the queued response headers and in-memory bodies with as few
+// sendmsg(2) calls as the socket allows, then the file body if there is one,
+// repeating for each part of a multipart/byteranges body. With io_uring, the
+// sends are queued on the ring, and the completion of each comes back here.
+// Returns 1 once the whole response is out, 0 if the socket is full or a
+// send is in flight, and -1 on error.
+static int write_response(struct Connection* conn) {
+  if (uring_sending(conn)) return 0;
+  for (;;) {
+    // Hold back a short header so that it goes out in the same segment as
+    // the first bytes of the body.
+    int more = conn->file_fd >= 0 || conn->ranges ? MSG_MORE : 0;
+    while (conn->opos < conn->olen + conn->bodies_len) {
+      if (uring.fd >= 0) {
+        uring_sendmsg(conn, more);
+        return 0;
+      }
+      struct iovec iov[2 * sizeof conn->bodies / sizeof conn->bodies[0] + 1];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = gather_output(conn, iov);
+      ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | more);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) return 0;
+        return -1;
+      }
+      conn->opos += n;
+      count_sent(conn, n);
+    }
+    clear_output(conn);
+    if (conn->file_fd >= 0) {
+      int ret =
+          uring.fd >= 0 ? uring_send_file(conn) : send_file_body(conn);
+      if (ret <= 0) return ret;
+      conn->file_fd = -1;
+    }
+    if (!conn->ranges) break;
+    output_next_range(conn);
+  }
+  if (conn->file) close_file_body(conn);
+  if (conn->first_byte_at) {
+    record_latency(STAGE_SEND, monotonic_usec() - conn->first_byte_at);
+  }
+  conn->parsed_at = conn->first_byte_at = 0;
+  return 1;
+}
+
+// Fills iov with the output buffer interleaved with the queued bodies,
+// skipping the conn->opos bytes already sent. Returns the number of entries.
+static int gather_output(struct Connection* conn, struct iovec* iov) {
+  int n = 0;
+  size_t skip = conn->opos;
+  size_t pos = 0;
+  for (int i = 0; i <= conn->nbodies; ++i) {
+    struct OutputBody* b = i < conn->nbodies ? &conn->bodies[i] : NULL;
+    const char* data[2] = {conn->obuf + pos, b ? b->data : NULL};
+    size_t len[2] = {(b ? b->pos : conn->olen) - pos, b ? b->len : 0};
+    for (int j = 0; j < 2; ++j) {
+      if (len[j] <= skip) {
+        skip -= len[j];
+        continue;
+      }
+      iov[n].iov_base = (char*)data[j] + skip;
+      iov[n].iov_len = len[j] - skip;
+      skip = 0;
+      ++n;
+    }
+    if (b) pos = b->pos;
+  }
+  return n;
+}
+
+// Drops the queued output, releasing the cache entries owning the bodies.
+static void clear_output(struct Connection* conn) {
+  for (int i = 0; i < conn->nbodies; ++i) {
+    if (conn->bodies[i].file) release_cached_file(conn->bodies[i].file);
+  }
+  conn->nbodies = 0;
+  conn->bodies_len = 0;
+  conn->olen = conn->opos = 0;
+}
+
+// Either closes the connection or gets it ready for the next request.
+// Returns 0 if the connection has been closed.
+static int finish_response(struct Connection* conn) {
+  if (!conn->keep_alive) {
+    linger_connection(conn);
+    return 0;
+  }
+  if (conn->state == CONN_WRITING) conn->state = CONN_READING_HEADER;
+  return 1;
+}
+
+// Closing a socket with unread input makes the kernel reset the connection,
+// which can destroy the end of the response before the client has read it.
+// So only the sending side is shut down, and input is read and dropped until
+// the client closes its side or KEEPALIVE_TIMEOUT passes.
+static void linger_connection(struct Connection* conn) {
+  if (shutdown(conn->fd, SHUT_WR) < 0) {
+    close_connection(conn);
+    return;
+  }
+  touch_connection(conn);
+  conn->state = CONN_LINGERING;
+  conn->ipos = conn->ilen = 0;
+  watch_connection(conn, EPOLLIN);
+}
+
+// Copies the file body to the socket inside the kernel. Returns 1 when the
+// body has been sent, 0 if the socket is full or the body is being read in,
+// and -1 on error.
+static int send_file_body(struct Connection* conn) {
+  if (conn->use_splice) return splice_file_body(conn);
+  while (conn->file_remaining > 0) {
+    off_t len = ready_body_len(conn);
+    if (!len) return 0;
+    ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 0;
+      if (errno == EINVAL || errno == ENOSYS) {
+        conn->use_splice = 1;
+        return splice_file_body(conn);
+      }
+      log_error("sendfile(2) failed: %s", strerror(errno));
+      return -1;
+    }
+    if (n == 0) {
+      log_error("file shrank while being sent");
+      return -1;
+    }
+    conn->file_remaining -= n;
+    count_sent(conn, n);
+  }
+  return 1;
+}
+
+// Returns how much of the rest of the file body can be sent without the
+// event loop waiting for the disk. With I/O threads, that is what has been
+// read in ahead; if nothing is, the next window is read in and 0 returned.
+static off_t ready_body_len(struct Connection* conn) {
+  if (file_jobs_fd < 0) return conn->file_remaining;
+  if (conn->file_offset < conn->ready_from ||
+      conn->file_offset >= conn->ready_to) {
+    start_read_ahead(conn);
+    return 0;
+  }
+  off_t len = conn->ready_to - conn->file_offset;
+  return len < conn->file_remaining ? len : conn->file_remaining;
+}
+
+static const size_t SPLICE_CHUNK_SIZE = 65536;
+// On the ring, each chunk of a file body costs a round trip through the
+// kernel's workers, so the pipe it goes through is enlarged where
+// /proc/sys/fs/pipe-max-size allows.
+static const int URING_PIPE_SIZE = 1 << 20;
+
+// Fallback for files that sendfile(2) refuses: moves the body through a
+// per-connection pipe with splice(2), still without copying to user space.
+static int splice_file_body(struct Connection* conn) {
+  if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+    log_error("pipe2(2) failed: %s", strerror(errno));
+    return -1;
+  }
+  while (conn->file_remaining > 0 || conn->piped > 0) {
+    if (conn->piped == 0) {
+      off_t ready = ready_body_len(conn);
+      if (!ready) return 0;
+      size_t len = ready < SPLICE_CHUNK_SIZE ? ready : SPLICE_CHUNK_SIZE;
+      ssize_t n = splice(conn->file_fd, &conn->file_offset, conn->pipe_fds[1],
+                         NULL, len, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        log_error("splice(2) failed: %s", n ? strerror(errno) : "short file");
+        return -1;
+      }
+      conn->piped = n;
+      conn->file_remaining -= n;
+    }
+    int more = conn->file_remaining > 0 ? SPLICE_F_MORE : 0;
+    ssize_t n = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->piped,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 0;
+      log_error("splice(2) failed: %s", strerror(errno));
+      return -1;
+    }
+    conn->piped -= n;
+    count_sent(conn, n);
+  }
+  return 1;
+}
+
+// The io_uring side of send_file_body(): queues a splice(2) of the next chunk
+// of the file into the pipe with the splice out to the socket linked behind
+// it, or only the latter while the pipe still holds data. The kernel reads a
+// cold file on its own workers. Returns 1 when the body has been sent, 0
+// while it is being sent and -1 on error.
+static int uring_send_file(struct Connection* conn) {
+  if (!conn->file_remaining && !conn->piped) return 1;
+  if (conn->pipe_fds[0] < 0) {
+    if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+      log_error("pipe2(2) failed: %s", strerror(errno));
+      return -1;
+    }
+    int size = fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+    if (size < 0) size = fcntl(conn->pipe_fds[1], F_GETPIPE_SZ);
+    conn->pipe_size = size > 0 ? (size_t)size : SPLICE_CHUNK_SIZE;
+  }
+  size_t len = conn->piped;
+  off_t left = conn->file_remaining;
+  struct io_uring_sqe* sqe;
+  if (!len) {
+    len = left < (off_t)conn->pipe_size ? (size_t)left : conn->pipe_size;
+    left -= len;
+    sqe = get_sqe(URING_SPLICE_IN, conn);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->splice_fd_in = conn->file_fd;
+    sqe->splice_off_in = conn->file_offset;
+    sqe->fd = conn->pipe_fds[1];
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    conn->uring_ops |= 1 << URING_SPLICE_IN;
+  }
+  sqe = get_sqe(URING_SPLICE_OUT, conn);
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->splice_fd_in = conn->pipe_fds[0];
+  sqe->splice_off_in = -1;
+  sqe->fd = conn->fd;
+  sqe->off = -1;
+  sqe->len = len;
+  sqe->splice_flags = SPLICE_F_MOVE | (left > 0 ? SPLICE_F_MORE : 0);
+  conn->uring_ops |= 1 << URING_SPLICE_OUT;
+  return 0;
+}
+
+static void close_file_body(struct Connection* conn) {
+  release_cached_file(conn->file);
+  conn->ranges = NULL;
+  conn->file = NULL;
+  conn->file_fd = -1;
+  conn->use_splice = 0;
+  conn->ready_from = conn->ready_to = 0;
+}
+
 static void become_daemon(void) {
   if (chdir("/") < 0) log_exit("chdir(2) failed: %s", strerror(errno));
   freopen("/dev/null", "r", stdin);